@@ -0,0 +1,341 @@
+/* Microbenchmarks for xish. Results are printed as tab separated "name value unit" lines,
+   so runs of different releases can be compared with diff or join */
+#define XISH_NO_MAIN
+#include "../xish.c"
+#include "../xishc.c"
+
+#include <signal.h>
+
+#define REPEAT 5
+
+/* Benchmark body, returns number of operations done */
+typedef long (*bench_f)(void *);
+
+/* Returns the median of REPEAT runs in nanoseconds per operation */
+double runBench(bench_f bench, void *arg)
+{
+	double results[REPEAT], tmp;
+	struct timespec begin, end;
+	long ops;
+	int i, j;
+
+	for (i = 0; i < REPEAT; ++i)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		ops = bench(arg);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		results[i] = ((end.tv_sec - begin.tv_sec) * 1e9 + (end.tv_nsec - begin.tv_nsec)) / ops;
+		for (j = i; j > 0 && results[j - 1] > results[j]; --j)
+		{
+			tmp = results[j];
+			results[j] = results[j - 1];
+			results[j - 1] = tmp;
+		}
+	}
+	return results[REPEAT / 2];
+}
+
+/* Points stdout and stderr to fd, saving the old ones in saved. With fd -1 restores them from saved */
+void swapOutput(int fd, int *saved)
+{
+	fflush(stdout);
+	fflush(stderr);
+	if (fd != -1)
+	{
+		saved[0] = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+		saved[1] = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0);
+	}
+	dup2(fd != -1 ? fd : saved[0], STDOUT_FILENO);
+	dup2(fd != -1 ? fd : saved[1], STDERR_FILENO);
+	if (fd == -1)
+	{
+		close(saved[0]);
+		close(saved[1]);
+	}
+}
+
+void report(char *name, double value, char *unit)
+{
+	printf("%s\t%.1f\t%s\n", name, value, unit);
+	fflush(stdout);
+}
+
+/* Generated input for lexer benchmarks */
+typedef struct
+{
+	char *text;
+	size_t len;
+	int lines;
+} input_t;
+
+/* Appends count copies of word to out */
+void repeat(FILE *out, char *word, int count)
+{
+	while (count-- > 0)
+		fputs(word, out);
+}
+
+/* Builds input of given number of lines, each line consists of prefix, count times repeated word and suffix */
+void makeInput(input_t *input, int lines, char *prefix, char *word, int count, char *suffix)
+{
+	FILE *out = open_memstream(&input->text, &input->len);
+	int i;
+
+	for (i = 0; i < lines; ++i)
+	{
+		fputs(prefix, out);
+		repeat(out, word, count);
+		fputs(suffix, out);
+		fputc('\n', out);
+	}
+	fclose(out);
+	input->lines = lines;
+}
+
+/* Runs readCommand and checkSyntax over the whole input */
+long benchLexer(void *arg)
+{
+	input_t *input = arg;
+	param_t *params = NULL;
+	int nparams;
+	FILE *in = fmemopen(input->text, input->len, "r");
+
+	while (readCommand(in, &params, &nparams) != RET_EOF)
+	{
+		checkSyntax(params, nparams);
+		clearParams(&params, nparams);
+	}
+	clearParams(&params, nparams);
+	fclose(in);
+	return input->lines;
+}
+
+/* Command line parsed once, launched many times */
+typedef struct
+{
+	param_t *params;
+	int nparams, iterations;
+} command_t;
+
+void parseCommand(command_t *command, char *line, int iterations)
+{
+	FILE *in = fmemopen(line, strlen(line), "r");
+
+	command->params = NULL;
+	readCommand(in, &command->params, &command->nparams);
+	fclose(in);
+	command->iterations = iterations;
+}
+
+/* Launches the command through controlJob as a foreground job and waits for it */
+long benchLaunch(void *arg)
+{
+	command_t *command = arg;
+	job_t *jobs = NULL;
+	int i, njobs = 0;
+
+	for (i = 0; i < command->iterations; ++i)
+		controlJob(command->params, command->nparams, 1, &jobs, &njobs);
+	clearJobs(&jobs, njobs);
+	return command->iterations;
+}
+
+/* Adds 1000 stopped jobs with nonexistent groups, then checks and deletes them */
+long benchJobs(void *arg)
+{
+	param_t word = { "job", WT_WORD };
+	job_t *jobs = NULL;
+	int i, njobs = 0;
+
+	for (i = 0; i < 1000; ++i)
+		addJob(&jobs, &njobs, &word, 1, INT_MAX - i, ST_STOPPED);
+	checkJobs(&jobs, &njobs);
+	deleteDoneJobs(&jobs, &njobs);
+	clearJobs(&jobs, njobs);
+	return 1000;
+}
+
+/* Adds 1000 deadlines of jobs with nonexistent groups in mixed order, then cancels them as the jobs finish */
+long benchDeadlines(void *arg)
+{
+	int i;
+
+	for (i = 0; i < 1000; ++i)
+		addDeadline(INT_MAX - i, -(INT_MAX - i), 3600000000LL + i * 7919 % 1000 * 1000000LL, SIGTERM, 0);
+	for (i = 0; i < 1000; ++i)
+		cancelDeadlines(INT_MAX - i);
+	return 1000;
+}
+
+/* Sends a line to cat coprocess and reads it back with read builtin */
+long benchCoproc(void *arg)
+{
+	command_t *command = arg;
+	int i;
+
+	for (i = 0; i < command->iterations; ++i)
+	{
+		write(coprocs[0].fds[1], "query\n", 6);
+		internalRead(command->params, command->nparams);
+	}
+	return command->iterations;
+}
+
+/* Starts xish binary with empty input */
+long benchStartup(void *arg)
+{
+	char *argv[] = { arg, NULL };
+	int i, fd;
+	pid_t pid;
+
+	for (i = 0; i < 50; ++i)
+	{
+		if ((pid = fork()) == 0)
+		{
+			fd = open("/dev/null", O_RDWR);
+			dup2(fd, STDIN_FILENO);
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+			execv(argv[0], argv);
+			_exit(127);
+		}
+		waitpid(pid, NULL, 0);
+	}
+	return 50;
+}
+
+/* Runs argv to completion 50 times, with output thrown away */
+long benchSpawn(void *arg)
+{
+	char **argv = arg;
+	int i, fd;
+	pid_t pid;
+
+	for (i = 0; i < 50; ++i)
+	{
+		if ((pid = fork()) == 0)
+		{
+			fd = open("/dev/null", O_RDWR);
+			dup2(fd, STDIN_FILENO);
+			dup2(fd, STDOUT_FILENO);
+			execv(argv[0], argv);
+			_exit(127);
+		}
+		waitpid(pid, NULL, 0);
+	}
+	return 50;
+}
+
+/* Sends 50 requests to the server from this process, like an orchestration agent would */
+long benchRequest(void *arg)
+{
+	int i, fd = open("/dev/null", O_RDWR), saved = dup(STDOUT_FILENO);
+
+	dup2(fd, STDOUT_FILENO);
+	for (i = 0; i < 50; ++i)
+		sendRequest(arg, "cd .");
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+	close(fd);
+	return 50;
+}
+
+/* Compares xish -c with requests to xish --serve made by xishc */
+void benchServe(char *xish, char *xishc)
+{
+	char sock[64], *execargv[] = { xish, "-c", "cd .", NULL }, *clientargv[] = { xishc, sock, "cd .", NULL };
+	char *serveargv[] = { xish, "--serve", sock, NULL };
+	pid_t server;
+	int i;
+
+	report("exec_c", 1e9 / runBench(benchSpawn, execargv), "req/s");
+
+	sprintf(sock, "/tmp/xish-bench-%d.sock", getpid());
+	if ((server = fork()) == 0)
+	{
+		execv(xish, serveargv);
+		_exit(127);
+	}
+	for (i = 0; i < 100 && access(sock, F_OK); ++i)
+		usleep(10000);
+	report("serve_xishc", 1e9 / runBench(benchSpawn, clientargv), "req/s");
+	report("serve_direct", 1e9 / runBench(benchRequest, sock), "req/s");
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+	unlink(sock);
+}
+
+int main(int argc, char **argv)
+{
+	input_t input;
+	command_t command;
+	char line[512];
+	int i, stages[] = { 1, 4, 16 }, njobs = 0, saved[2], devnull;
+	job_t *jobs = NULL;
+
+	/* There is no terminal to hand over, run like a subshell does */
+	issubshell = 1;
+	setenv("XISHBENCH", "value", 1);
+
+	makeInput(&input, 20, "echo", " word", 10000, "");
+	report("lex_long_line", runBench(benchLexer, &input) / 1000, "us/line");
+	free(input.text);
+	memset(line, '(', 100);
+	strcpy(line + 100, "echo x");
+	memset(line + 106, ')', 100);
+	line[206] = '\0';
+	makeInput(&input, 200, "", line, 1, "");
+	report("lex_deep_brackets", runBench(benchLexer, &input) / 1000, "us/line");
+	free(input.text);
+	makeInput(&input, 20000, "cmd", " a b c d e f g h", 8, " > file && next | filter");
+	report("lex_many_words", runBench(benchLexer, &input), "ns/line");
+	free(input.text);
+	makeInput(&input, 2000, "echo", " $XISHBENCH$HOME", 50, "");
+	report("lex_env_vars", runBench(benchLexer, &input), "ns/line");
+	free(input.text);
+
+	for (i = 0; i < sizeof(stages) / sizeof(*stages); ++i)
+	{
+		strcpy(line, "true");
+		while (strlen(line) < stages[i] * 7 - 3)
+			strcat(line, " | true");
+		strcat(line, "\n");
+		parseCommand(&command, line, 100);
+		sprintf(line, "launch_pipeline_%d", stages[i]);
+		report(line, runBench(benchLaunch, &command) / 1000, "us/job");
+		clearParams(&command.params, command.nparams);
+	}
+
+	parseCommand(&command, "cd .\n", 10000);
+	report("launch_builtin", runBench(benchLaunch, &command) / 1000, "us/job");
+	clearParams(&command.params, command.nparams);
+	parseCommand(&command, "pwd | true\n", 200);
+	report("launch_builtin_pipeline", runBench(benchLaunch, &command) / 1000, "us/job");
+	clearParams(&command.params, command.nparams);
+	parseCommand(&command, "true\n", 200);
+	report("launch_external", runBench(benchLaunch, &command) / 1000, "us/job");
+	clearParams(&command.params, command.nparams);
+
+	parseCommand(&command, "coproc cat\n", 1);
+	devnull = open("/dev/null", O_WRONLY);
+	swapOutput(devnull, saved);
+	issubshell = 0;
+	internalCoproc(command.params, command.nparams, &jobs, &njobs);
+	issubshell = 1;
+	swapOutput(-1, saved);
+	close(devnull);
+	clearParams(&command.params, command.nparams);
+	sprintf(line, "read -u %d R\n", coprocs[0].fds[0]);
+	parseCommand(&command, line, 10000);
+	report("coproc_roundtrip", runBench(benchCoproc, &command) / 1000, "us/query");
+	clearParams(&command.params, command.nparams);
+	closeCoprocs();
+	clearJobs(&jobs, njobs);
+
+	report("jobs_1k", runBench(benchJobs, NULL), "ns/job");
+	report("deadlines_1k", runBench(benchDeadlines, NULL), "ns/deadline");
+	report("startup", runBench(benchStartup, argc > 1 ? argv[1] : "./xish") / 1000, "us");
+	benchServe(argc > 1 ? argv[1] : "./xish", argc > 2 ? argv[2] : "./xishc");
+
+	return 0;
+}
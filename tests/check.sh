@@ -0,0 +1,334 @@
+#!/bin/sh
+# Behavior checks of xish, run by make check. Every check feeds a script to xish in a scratch directory
+# and compares its output with the expected one. Pids of background jobs are replaced by PID
+xish=$(cd "$(dirname "${1:-./xish}")" && pwd)/$(basename "${1:-./xish}")
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+export HOME="$tmp"
+unset XDG_CACHE_HOME XISH_TRACE XISH_STATS XISH_CGROUP
+failed=0
+
+# compare name expected actual
+compare()
+{
+	if [ "$3" = "$2" ]; then
+		echo "ok	$1"
+	else
+		printf 'FAIL	%s\n--- expected\n%s\n--- actual\n%s\n' "$1" "$2" "$3"
+		failed=1
+	fi
+}
+
+# check name expected: runs xish on the standard input
+check()
+{
+	compare "$1" "$2" "$(cd "$tmp" && timeout 20 "$xish" 2>&1 | sed 's/^\(\[[0-9]*\]\) [0-9][0-9]*$/\1 PID/')"
+}
+
+# Background jobs that would keep the output pipe open run as nap, and are killed by that name
+cp "$(command -v sleep)" "$tmp/nap"
+
+XISH_TRACE="$tmp/trace.json" "$xish" -c 'echo a | cat' > /dev/null
+check trace "[
+1
+1" <<'XSH'
+head -n 1 trace.json
+grep -c "fork echo" trace.json
+grep -c "exec cat" trace.json
+XSH
+
+# Warm start substitutes current variables and reports syntax errors again
+printf 'echo rc $RCVAR\n| echo bad\necho rc end\n' > "$tmp/.xishrc"
+RCVAR=a "$xish" -c true > /dev/null 2>&1
+RCVAR=b check rc-cache "rc b
+xish: syntax error near |
+rc end" <<'XSH'
+XSH
+
+# Malformed cache, here a word with unknown type, is ignored
+sed -i 's/\x00end/\x63end/' "$tmp/.xishrc.cache"
+RCVAR=b check rc-cache-bad "rc b
+xish: syntax error near |
+rc end" <<'XSH'
+XSH
+rm -f "$tmp/.xishrc" "$tmp/.xishrc.cache"
+
+# Server doesn't replace a file that isn't a socket, reaps its workers while it is idle and passes statuses back
+xishc=$(dirname "$xish")/xishc
+if [ -x "$xishc" ]; then
+	echo keep > "$tmp/file"
+	timeout 2 "$xish" --serve "$tmp/file" 2> /dev/null
+	"$xish" --serve "$tmp/sock" &
+	server=$!
+	sleep 0.3
+	"$xishc" "$tmp/sock" "echo hi" > /dev/null
+	sleep 0.3
+	compare serve "keep 0" "$(cat "$tmp/file") $(ps --ppid $server -o stat= | grep -c Z)"
+	# Script statuses come back like xish -c exits, 2 stays for transport errors
+	"$xishc" "$tmp/sock" "\"$tmp/nap\" 0.1 &" > /dev/null
+	status=$?
+	"$xishc" "$tmp/none" "true" 2> /dev/null
+	compare serve-status "255 2" "$status $?"
+	kill $server
+fi
+
+# exec leaves no fds of the shell to the command, and the last command of -c replaces the shell
+compare exec-fds "$(cd "$tmp" && "$xish" -c "ls /proc/self/fd")" "$(cd "$tmp" && "$xish" -c "exec ls /proc/self/fd")"
+echo 'echo $$' > "$tmp/pid.sh"
+(cd "$tmp" && exec "$xish" -c "sh pid.sh > pid.out") &
+shell=$!
+wait $shell
+compare tail-exec "$shell" "$(cat "$tmp/pid.out")"
+
+# The shell doesn't become the last command while it drains captured output of background jobs
+check tail-exec-capture "done" <<XSH
+$xish -c "set -o capture-bg; sh -c \"sleep 0.3; echo late; echo done > marker\" & sleep 1" > /dev/null
+cat marker
+XSH
+
+# pwd stage runs inside the shell, only cat is forked
+check builtin-stage "$tmp
+forks	1
+builtins	2" <<'XSH'
+xstat -r
+pwd | cat
+xstat > s
+grep -E "^(forks|builtins)" s
+XSH
+
+# Second source of an unchanged script uses the cache, a changed script is parsed again
+echo "echo one" > "$tmp/one.xsh"
+check source-cache "source: one.xsh: parsed
+one
+source: one.xsh: cached
+one
+source: one.xsh: parsed
+three" <<'XSH'
+source -v one.xsh
+source -v one.xsh
+echo "echo three" > one.xsh
+. -v one.xsh
+XSH
+
+check memo "hi
+hi
+1 hits, 1 misses, 0 evictions, 1 entries" <<'XSH'
+memo echo hi
+memo echo hi
+memo --stats | cut -d , -f 1-4
+XSH
+
+# Entry with the same name but another key, like a hash collision, is not replayed
+for entry in "$tmp"/.cache/xish/memo/*; do sed -i 's/echo/ECHO/' "$entry"; done
+check memo-key "hi
+0 hits, 1 misses" <<'XSH'
+memo echo hi
+memo --stats | cut -d , -f 1-2
+XSH
+
+check affinity "[1] PID
+[cpu any]" <<'XSH'
+set -o pipeline-affinity=compact
+sleep 0.2 &
+jobs -l > jobs.out
+cut -f 4 jobs.out
+XSH
+
+# Numeric options need a value and keep their minimum
+check set-numeric "xish: usage: set -o name=N
+xish: usage: set -o name=N
+xish: set: option can't be turned off
+job-deadline	0
+capture-size	65536" <<'XSH'
+set -o capture-size
+set -o job-deadline
+set +o capture-size
+set > opts
+grep -E "^(job-deadline|capture-size)" opts
+XSH
+
+check ulimit-range "xish: 72057594037927936: Numerical result out of range
+1000" <<'XSH'
+ulimit -f 72057594037927936
+ulimit -f 1000
+ulimit -f
+XSH
+
+# Foreground limited jobs print nothing of their own, cgroup settings need XISH_CGROUP
+check limit-foreground "ok
+xish: cpu=50%: no delegated cgroup v2, ignored
+ok" <<'XSH'
+limit mem=1G echo ok
+limit cpu=50% echo ok
+XSH
+
+check deadlines "timed out
+[1] PID
+[1] Done		sleep 5 " <<'XSH'
+timeout 0.2 sleep 5 || echo timed out
+set -o job-deadline=1
+sleep 5 &
+sleep 1.5
+XSH
+
+check timeout-usage "xish: timeout: -x: unknown option
+xish: usage: timeout [-s SIG] [-k KILL_AFTER] DURATION command
+xish: FOO: Invalid argument" <<'XSH'
+timeout -x 1 true
+timeout -s FOO 1 true
+XSH
+
+# The deadline has to fire while the shell waits for more input
+(echo 'set -o job-deadline=1'; echo 'sleep 5 &'; sleep 2; echo 'echo next') | (cd "$tmp" && timeout 20 "$xish" > deadline.out)
+check input-deadline "[1] Done		sleep 5 " <<'XSH'
+grep Done deadline.out
+XSH
+
+# Background job of the script keeps the output pipe open, so it is killed by its own name
+echo 'echo inner' > "$tmp/inner"
+check source-deadline "[1] PID
+inner
+done
+[1] Done		./nap 60 > /dev/null " <<'XSH'
+set -o job-deadline=60
+./nap 60 > /dev/null &
+source inner
+echo done
+pkill -x nap
+sleep 0.2
+XSH
+
+echo 'echo inner' > "$tmp/inner"
+check source-capture "[1] PID
+inner
+done
+[1] Done		./nap 60 " <<'XSH'
+set -o capture-bg=ring
+./nap 60 &
+source inner
+echo done
+pkill -x nap
+sleep 0.2
+XSH
+
+# The rc file is read from memory on both cold and warm (cached) starts
+printf 'set -o capture-bg=ring\n./nap 60 &\necho rc done\n' > "$tmp/.xishrc"
+check rc-capture "rc done
+rc done
+warm
+[1] PID
+[1] PID
+[1] Done		./nap 60 " <<XSH
+$xish -c "echo warm"
+pkill -x nap
+sleep 0.2
+XSH
+rm -f "$tmp/.xishrc" "$tmp/.xishrc.cache"
+
+check capture-ring "[1] PID
+[1] Done		echo 0123456789abcdef 
+9abcdef" <<'XSH'
+set -o capture-bg=ring
+set -o capture-size=8
+echo 0123456789abcdef &
+sleep 0.3
+XSH
+
+# Diagnostics of a builtin stage run inside the shell are output of the job, like ones of forked stages
+check capture-diagnostics "[1] PID
+[1] Done		jobs -o 9 | cat 
+xish: no such job" <<'XSH'
+set -o capture-bg
+jobs -o 9 | cat &
+sleep 0.3
+XSH
+
+mkdir "$tmp/spill"
+export TMPDIR="$tmp/spill"
+check capture-spill "0
+[1] PID
+[1] Done		echo spilled 
+spilled" <<'XSH'
+set -o capture-bg=spill
+echo spilled &
+sleep 0.3
+ls spill | wc -l
+XSH
+
+check coproc "[1] PID
+got hello world" <<'XSH'
+coproc C cat
+echo hello world >&${C[1]}
+read -u ${C[0]} line
+echo got $line
+XSH
+
+# Forked commands keep only the coprocess descriptors they name in read -u or >&, <&, not just any equal word
+printf '#!/bin/sh\nls /proc/$PPID/fd | grep -cx "$1"\n' > "$tmp/hasfd"
+chmod +x "$tmp/hasfd"
+check coproc-fds "[1] PID
+0
+1
+[2] PID
+[2] Done		source fds 60 60 
+[2] PID
+[2] Done		source fds 60 <& 60 " <<'XSH'
+coproc C cat
+echo "./hasfd ${C[0]}
+cd ." > fds
+source fds ${C[0]} ${C[0]} &
+./nap 0.3
+source fds ${C[0]} <&${C[0]} &
+./nap 0.3
+XSH
+
+export HOME_dir=/x_y
+check variables "/x_y $tmp/dir
+a
+b" <<'XSH'
+echo $HOME_dir ${HOME}/dir
+echo a${HOME
+echo b
+XSH
+
+# Failed execs are counted in each PATH directory they are tried in, also when the command is found later
+path=$PATH
+PATH="$tmp/nowhere:$PATH"
+check xstat "xish: nosuchcmd: No such file or directory
+exec_failures	1
+exec_failures[$tmp/nowhere]	2
+s1:forks	2
+s2:forks	2" <<'XSH'
+xstat -r
+nosuchcmd
+sleep 0
+xstat > s1
+xstat > s2
+grep -e "^exec_failures	" -e nowhere s1
+grep ^forks s1 s2
+XSH
+PATH=$path
+
+# true with arguments of about 2.5 ARG_MAX
+awk -v n="$(getconf ARG_MAX)" 'BEGIN { printf "true"; for (i = 0; i < n / 10; ++i) printf " %016d", i; print "" }' > "$tmp/long"
+check batch "2
+a b
+c d
+xish: true: Argument list too long
+split" <<'XSH'
+batch -P 2 echo a b c d > out
+wc -l < out
+sort out
+source long
+set -o autosplit
+source long && echo split
+XSH
+
+# Other children of the process running the batch are not taken for chunks
+check batch-children "chunk
+after" <<'XSH'
+( sleep 0.1 & batch sh -c "sleep 0.5; echo chunk" )
+echo after
+XSH
+
+exit $failed
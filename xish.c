@@ -1,41 +1,166 @@
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <linux/mempolicy.h>
 #include <fcntl.h>
 #include <error.h>
 #include <errno.h>
+#include <time.h>
+#include <pwd.h>
+#include <dirent.h>
+#include <sched.h>
+#include <poll.h>
+#include <signal.h>
 
 #include <limits.h>
 #include <stdio.h>
+#include <stdio_ext.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <ctype.h>
 
 #define STR_SIZE 128
 #define PARAM_COUNT 5
 #define DFL_PROMPT "$ "
 #define CONT_PROMPT "> "
+#define RC_FILE ".xishrc"
+#define RC_CACHE ".xishrc.cache"
+#define CACHE_MAGIC "XISHRC3"
+#define SERVE_MAXLEN (1 << 20)
+#define MEMO_SIZE (64LL << 20)
+#define CPU_PREFIX "@cpu="
+#define CPU_PERIOD 100000
+#define CAPTURE_SIZE 65536
+#define COPROC_FD 60
+#define COPROC_GRACE 100
+#define STATS_DIRS 32
+#define STATS_DIRLEN 128
+#define STATS_BUCKETS 32
+#define ARG_HEADROOM 2048
+#define TRACE_EVENTS 256
+#define TRACE_NAME 48
+
+/* Adds n to statistics counter. Relaxed, as nothing is ordered by the counters */
+#define STAT_ADD(counter, n) __atomic_fetch_add(&stats->counter, (n), __ATOMIC_RELAXED)
+
+/* Current time for tracing, doesn't make a syscall when tracing is off */
+#define TRACE_NOW() (tracefd == -1 ? 0 : traceTime())
+
+int issubshell = 0, isinteractive = 0, envready = 0;
+
+/* Set when the shell process may be replaced with the last command it runs, instead of forking it */
+int tailexec = 0;
+
+/* Set by the lexer when it has substituted a variable */
+int lexedvars = 0;
+
+/* Memo builtin statistics */
+int memohits = 0, memomisses = 0, memoevictions = 0;
+
+/* Number of cgroups made for limited jobs, makes their names unique */
+int limitseq = 0;
 
-int issubshell = 0;
+/* Server worker's connection to the client, status is sent there on exit */
+int replyfd = -1;
+pid_t replypid;
 
 typedef enum { RET_OK, RET_EOF, RET_MEMORYERR } result_t;
 
 typedef enum { ST_NONE, ST_RUNNING, ST_DONE, ST_STOPPED, ST_JUSTSTP } status_t;
 
+typedef enum { AF_NONE, AF_SPREAD, AF_COMPACT } affinity_t;
+
 typedef enum { WT_WORD = 0, WT_LBRACKET, WT_RBRACKET, WT_FILERD, WT_FILEWRTRUNC, WT_FILEWRAPPEND, WT_BACKGROUND,
-               WT_AND, WT_OR, WT_SEMICOLON, WT_PIPE } word_t;
+               WT_AND, WT_OR, WT_SEMICOLON, WT_PIPE, WT_DUPOUT, WT_DUPIN } word_t;
 
-/* Checks if word is '>', '<' or '>>' */
-#define IS_FILEOP(a) ((a) == WT_FILEWRAPPEND || (a) == WT_FILEWRTRUNC || (a) == WT_FILERD)
+/* Checks if word is '>', '<', '>>', '>&' or '<&' */
+#define IS_FILEOP(a) ((a) == WT_FILEWRAPPEND || (a) == WT_FILEWRTRUNC || (a) == WT_FILERD || (a) == WT_DUPOUT || (a) == WT_DUPIN)
 
 /* Struct for storing job information */
 typedef struct
 {
 	char *job;
+	char *placement;
+	char *cgroup;
+	long long peak;
+	struct capture *capture;
 	int pgid;
 	status_t status;
 } job_t;
 
+/* Struct for storing captured output of background job: ring buffer of the last size bytes, or unlinked spill file.
+   fd is the read end of the job's pipe, -1 after EOF. total counts all the bytes, shown ones were already shown */
+typedef struct capture
+{
+	int fd, spillfd, size, echo;
+	char *ring;
+	long long total, shown;
+} capture_t;
+
+/* Struct for storing resource limits of one job: its cgroup v2 leaf, or memory rlimit used when there is no cgroup.
+   active is set when the job has limit prefix */
+typedef struct
+{
+	char *cgroup;
+	long long mem;
+	int active;
+} limit_t;
+
+/* Struct for storing deadline of a job. Job is identified by key, its pgid or, when it shares process group
+   with a subshell, its last pid. target is the process group to signal. killafter is delay of SIGKILL after sig */
+typedef struct
+{
+	long long when, killafter;
+	pid_t key, target;
+	int sig;
+} deadline_t;
+
+/* Struct for storing resource shown and changed by ulimit builtin, unit is the ulimit unit in rlimit units */
+typedef struct
+{
+	char flag;
+	int resource;
+	int unit;
+	char *name;
+} ulimit_t;
+
+/* Struct for storing shell variable, shell variables are not exported to commands */
+typedef struct var
+{
+	char *name, *value;
+	struct var *next;
+} var_t;
+
+/* Struct for storing coprocess. fds are the shell ends of its pipes: [0] reads its output, [1] writes its input */
+typedef struct
+{
+	char *name;
+	pid_t pid;
+	int fds[2];
+} coproc_t;
+
+/* Struct for storing shell option, choices are names of option values if it has them.
+   Option without choices is numeric, its value is at least min */
+typedef struct
+{
+	char *name;
+	int *value;
+	char **choices;
+	int min;
+} option_t;
+
 /* Struct for storing parameters */
 typedef struct
 {
@@ -43,6 +168,123 @@ typedef struct
 	word_t type;
 } param_t;
 
+/* Struct for storing one parsed line of a script. Variables are substituted by the lexer, so lines using them
+   are kept as text and lexed every time they are run */
+typedef struct
+{
+	param_t *params;
+	int nparams;
+	char *text;
+} line_t;
+
+/* Struct for storing parsed script. Scripts loaded from cache keep all the words in data and all the params in pool */
+typedef struct
+{
+	line_t *lines;
+	int nlines;
+	char *data;
+	param_t *pool;
+} script_t;
+
+/* Struct for storing script parsed by source builtin, valid while the file keeps its identity */
+typedef struct srccache
+{
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	off_t size;
+	script_t script;
+	int busy, stale;
+	struct srccache *next;
+} srccache_t;
+
+/* Struct for storing memo cache entry while looking for entries to evict */
+typedef struct
+{
+	char name[17];
+	long long used, size;
+} memo_t;
+
+/* Header of parsed script cache, identifies the source file version */
+typedef struct
+{
+	char magic[8];
+	long long dev, ino, mtimesec, mtimensec, size;
+	int nlines, nparams, datalen;
+} cachehdr_t;
+
+/* Struct for storing one trace event, ph is the Chrome trace phase ('X' - complete, 'i' - instant) */
+typedef struct
+{
+	char name[TRACE_NAME];
+	char ph;
+	long long ts, dur;
+	pid_t pid, pgid;
+} trace_t;
+
+/* Struct for storing statistics of the shell. It is shared with forked processes, so they count into it too.
+   Failed execs are counted per PATH directory, in the slot claimed by the hash of its name, the last slot takes the rest.
+   Histograms count durations by log2 of microseconds */
+typedef struct
+{
+	long long forks, execs, execfails, builtins, lexbytes, lines, charallocs, paramallocs, joballocs, checkwaits;
+	unsigned long long dirhashes[STATS_DIRS];
+	char dirnames[STATS_DIRS][STATS_DIRLEN];
+	long long dirfails[STATS_DIRS];
+	long long parse[STATS_BUCKETS], launch[STATS_BUCKETS], wait[STATS_BUCKETS];
+} stats_t;
+
+/* Shell options, changed by set builtin */
+int pipelineaffinity = AF_NONE;
+char *affinitynames[] = { "none", "spread", "compact", NULL };
+
+/* First cpu of the last launched pipeline, relative to allowed ones. Each pipeline starts after the previous one,
+   so separate pipelines don't pile onto the same cpus */
+int affinitybase = 0, affinitynext = 0;
+int jobdeadline = 0, capturebg = 0, capturesize = CAPTURE_SIZE, autosplit = 0;
+char *capturenames[] = { "off", "ring", "spill", NULL }, *switchnames[] = { "off", "on", NULL };
+option_t options[] = { { "pipeline-affinity", &pipelineaffinity, affinitynames, 0 }, { "job-deadline", &jobdeadline, NULL, 0 },
+                       { "capture-bg", &capturebg, capturenames, 0 }, { "capture-size", &capturesize, NULL, 1 },
+                       { "autosplit", &autosplit, switchnames, 0 }, { NULL, NULL, NULL, 0 } };
+
+/* Resources of ulimit builtin, -f is the default one */
+ulimit_t ulimits[] = { { 'c', RLIMIT_CORE, 512, "core file size (blocks)" }, { 'd', RLIMIT_DATA, 1024, "data seg size (kbytes)" },
+                       { 'f', RLIMIT_FSIZE, 512, "file size (blocks)" }, { 'l', RLIMIT_MEMLOCK, 1024, "max locked memory (kbytes)" },
+                       { 'n', RLIMIT_NOFILE, 1, "open files" }, { 's', RLIMIT_STACK, 1024, "stack size (kbytes)" },
+                       { 't', RLIMIT_CPU, 1, "cpu time (seconds)" }, { 'u', RLIMIT_NPROC, 1, "max user processes" },
+                       { 'v', RLIMIT_AS, 1024, "virtual memory (kbytes)" }, { 0, 0, 0, NULL } };
+
+/* Pending deadlines of jobs as binary min-heap, timerfd is armed for the earliest one. SIGCHLD is blocked and read
+   from signalfd while there are deadlines. expiredjob is the key of the last job whose deadline has expired */
+deadline_t *deadlines = NULL;
+int ndeadlines = 0, maxdeadlines = 0, timerfd = -1, sigchldfd = -1;
+pid_t expiredjob = 0;
+
+/* Captures of background jobs whose pipes are drained by the shell, and poll array for the event loop */
+capture_t **captures = NULL;
+int ncaptures = 0, maxpollfds = 0;
+struct pollfd *pollfds = NULL;
+
+/* Shell variables, and coprocesses closed at exit of the shell that has started them */
+var_t *shellvars = NULL;
+coproc_t *coprocs = NULL;
+int ncoprocs = 0;
+pid_t coprocowner = 0;
+
+/* Statistics, moved to shared memory by statsInit. statsfile is dumped at exit of statsowner */
+stats_t statsbuf, *stats = &statsbuf;
+char *statsfile = NULL;
+pid_t statsowner = 0;
+
+/* Scripts parsed by source builtin and its statistics */
+srccache_t *sourcecache = NULL;
+int sourcehits = 0, sourcemisses = 0;
+
+/* Per-process trace buffer. Children reset it after fork, so every event is written exactly once */
+int tracefd = -1, ntrace = 0;
+trace_t tracebuf[TRACE_EVENTS];
+long long parsestart = 0;
+
 /* Terminates program, for use in subshells */
 void fatalError()
 {
@@ -56,6 +298,185 @@ int nonfatalError(int errornum, char *message)
 	return -1;
 }
 
+/* Returns monotonic time in microseconds */
+long long traceTime()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* Writes buffered trace events to the trace file in one append */
+void traceFlush()
+{
+	char out[TRACE_EVENTS * (TRACE_NAME * 2 + 96)], *p = out, *c;
+	int i;
+
+	if (tracefd == -1 || ntrace == 0)
+		return;
+	for (i = 0; i < ntrace; ++i)
+	{
+		p += sprintf(p, "{\"name\":\"");
+		for (c = tracebuf[i].name; *c; ++c)
+			if (*c == '"' || *c == '\\')
+			{
+				*p++ = '\\';
+				*p++ = *c;
+			}
+			else
+				*p++ = iscntrl((unsigned char)*c) ? ' ' : *c;
+		p += sprintf(p, "\",\"ph\":\"%c\",\"ts\":%lld,", tracebuf[i].ph, tracebuf[i].ts);
+		if (tracebuf[i].ph == 'X')
+			p += sprintf(p, "\"dur\":%lld,", tracebuf[i].dur);
+		else
+			p += sprintf(p, "\"s\":\"t\",");
+		p += sprintf(p, "\"pid\":%d,\"tid\":%d},\n", tracebuf[i].pgid, tracebuf[i].pid);
+	}
+	ntrace = 0;
+	write(tracefd, out, p - out);
+}
+
+/* Records trace event "kind word" for process pid from group pgid (0 means the calling process).
+   Instant events are recorded when dur is negative */
+void traceEvent(char *kind, char *word, long long ts, long long dur, pid_t pid, pid_t pgid)
+{
+	trace_t *event;
+
+	if (tracefd == -1)
+		return;
+	if (ntrace == TRACE_EVENTS)
+		traceFlush();
+	event = tracebuf + ntrace++;
+	snprintf(event->name, TRACE_NAME, word == NULL ? "%s" : "%s %s", kind, word);
+	event->ph = dur < 0 ? 'i' : 'X';
+	event->ts = ts;
+	event->dur = dur;
+	event->pid = pid ? pid : getpid();
+	event->pgid = pgid ? pgid : getpgrp();
+}
+
+/* Records complete event that has started at begin and ends now */
+void traceSpan(char *kind, char *word, long long begin)
+{
+	if (tracefd != -1)
+		traceEvent(kind, word, begin, traceTime() - begin, 0, 0);
+}
+
+/* Opens trace file given by XISH_TRACE. The variable is removed, so nested shells don't truncate the file */
+void traceInit()
+{
+	char *file = getenv("XISH_TRACE");
+
+	if (file == NULL || *file == '\0')
+		return;
+	if ((tracefd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644)) == -1)
+	{
+		nonfatalError(errno, file);
+		return;
+	}
+	/* Chrome and Perfetto accept unterminated event arrays, so children can append events independently */
+	write(tracefd, "[\n", 2);
+	unsetenv("XISH_TRACE");
+	atexit(traceFlush);
+}
+
+/* Adds duration in microseconds to histogram */
+void statTime(long long *hist, long long us)
+{
+	int bucket = us > 0 ? 64 - __builtin_clzll(us) : 0;
+
+	__atomic_fetch_add(&hist[bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1], 1, __ATOMIC_RELAXED);
+}
+
+/* Writes histogram as "name [from,to) count" lines of non-empty buckets */
+void showHistogram(FILE *out, char *name, long long *hist)
+{
+	int i;
+
+	for (i = 0; i < STATS_BUCKETS; ++i)
+		if (hist[i])
+			fprintf(out, "%s_us\t[%lld,%lld)\t%lld\n", name, i ? 1LL << (i - 1) : 0, 1LL << i, hist[i]);
+}
+
+/* Writes statistics as tab separated lines */
+void showStats(FILE *out)
+{
+	int i;
+
+	fprintf(out, "forks\t%lld\nexecs\t%lld\nexec_failures\t%lld\n", stats->forks, stats->execs, stats->execfails);
+	for (i = 0; i < STATS_DIRS; ++i)
+		if (stats->dirfails[i])
+			fprintf(out, "exec_failures[%s]\t%lld\n", i < STATS_DIRS - 1 ? stats->dirnames[i] : "other",
+			        stats->dirfails[i]);
+	fprintf(out, "builtins\t%lld\nbytes_lexed\t%lld\nlines_parsed\t%lld\n", stats->builtins, stats->lexbytes, stats->lines);
+	fprintf(out, "allocs_addChar\t%lld\nallocs_addParam\t%lld\nallocs_addJob\t%lld\n", stats->charallocs,
+	        stats->paramallocs, stats->joballocs);
+	fprintf(out, "checkjobs_waitpid\t%lld\n", stats->checkwaits);
+	showHistogram(out, "parse", stats->parse);
+	showHistogram(out, "launch", stats->launch);
+	showHistogram(out, "wait", stats->wait);
+}
+
+/* Writes statistics into XISH_STATS file at exit of the shell */
+void dumpStats()
+{
+	FILE *out;
+
+	if (statsowner != getpid())
+		return;
+	if ((out = fopen(statsfile, "w")) == NULL)
+	{
+		nonfatalError(errno, statsfile);
+		return;
+	}
+	showStats(out);
+	fclose(out);
+}
+
+/* Moves statistics into memory shared with forked processes. XISH_STATS is removed, so nested shells don't
+   overwrite the file */
+void statsInit()
+{
+	stats_t *ptr;
+	char *file = getenv("XISH_STATS");
+
+	if ((ptr = mmap(NULL, sizeof(stats_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) != MAP_FAILED)
+	{
+		memcpy(ptr, stats, sizeof(stats_t));
+		stats = ptr;
+	}
+	if (file == NULL || *file == '\0' || (statsfile = strdup(file)) == NULL)
+		return;
+	unsetenv("XISH_STATS");
+	statsowner = getpid();
+	atexit(dumpStats);
+}
+
+/* Prepares freshly forked child: drops events recorded by the parent, its deadlines, captured pipes, coprocesses,
+   unread input and unwritten output.
+   Otherwise exit() would seek the shared stdin back and the parent would read the same lines again */
+void initChild()
+{
+	sigset_t set;
+
+	if (timerfd != -1)
+	{
+		close(timerfd);
+		close(sigchldfd);
+		timerfd = sigchldfd = -1;
+		ndeadlines = 0;
+		sigemptyset(&set);
+		sigaddset(&set, SIGCHLD);
+		sigprocmask(SIG_UNBLOCK, &set, NULL);
+	}
+	while (ncaptures > 0)
+		close(captures[--ncaptures]->fd);
+	ntrace = 0;
+	STAT_ADD(forks, 1);
+	__fpurge(stdin);
+	__fpurge(stdout);
+}
+
 /* Reallocates str if it has reached maximum capacity */
 int checkStringLen(char **pstr, int len)
 {
@@ -64,6 +485,7 @@ int checkStringLen(char **pstr, int len)
 		return 0;
 	if (len == 0)
 		*pstr = NULL;
+	STAT_ADD(charallocs, 1);
 	if ((ptr = realloc(*pstr, (len + STR_SIZE) * sizeof(char))) == NULL)
 		return nonfatalError(errno, NULL);
 	*pstr = ptr;
@@ -95,13 +517,15 @@ int addChar(char **str, int *len, char ch)
 	return 0;
 }
 
-/* Realocates params if it has reached maximum capacity */
+/* Realocates params if it has reached maximum capacity. Capacity doubles from PARAM_COUNT,
+   so long commands are not copied over and over */
 int checkParamCnt(param_t **params, int nparams)
 {
 	param_t *ptr;
-	if (nparams % PARAM_COUNT > 0)
+	if (nparams % PARAM_COUNT > 0 || (nparams / PARAM_COUNT & (nparams / PARAM_COUNT - 1)))
 		return 0;
-	if ((ptr = realloc(*params, (nparams + PARAM_COUNT) * sizeof(param_t))) == NULL)
+	STAT_ADD(paramallocs, 1);
+	if ((ptr = realloc(*params, (nparams ? 2 * nparams : PARAM_COUNT) * sizeof(param_t))) == NULL)
 		return nonfatalError(errno, NULL);
 	*params = ptr;
 	return 0;
@@ -141,185 +565,715 @@ void printParams(param_t *params, int nparams)
 	putchar('\n');
 }
 
-/* Adds new entry to jobs array, initializes the structure with given data */
-int addJob(job_t **jobs, int *njobs, param_t *command, int nparams, int pgid, status_t status)
-{
-	int len = nparams + 1, i;
-	job_t *ptr;
+char *describePlacement(param_t *, int);
+void releaseCgroup(char **);
+void releaseCapture(capture_t **);
+void releaseCoproc(pid_t);
 
-	if ((ptr = realloc(*jobs, (*njobs + 1) * sizeof(job_t))) == NULL)
-		return nonfatalError(errno, NULL);
+/* Arms timerfd for the earliest deadline, or disarms it if there are none */
+void armTimer()
+{
+	struct itimerspec its;
 
-	*jobs = ptr;
-	ptr = *jobs + *njobs;
-	ptr->pgid = pgid;
-	ptr->status = status;
-	++(*njobs);
+	memset(&its, 0, sizeof(its));
+	if (ndeadlines > 0)
+	{
+		its.it_value.tv_sec = deadlines[0].when / 1000000;
+		its.it_value.tv_nsec = deadlines[0].when % 1000000 * 1000 + 1;
+	}
+	timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
 
-	for (i = 0; i < nparams; ++i)
-		len += strlen(command[i].word);
-	if ((ptr->job = calloc(len + 1, sizeof(char))) == NULL)
-		return nonfatalError(errno, NULL);
+/* Restores heap order after deadline i has changed */
+void fixDeadline(int i)
+{
+	deadline_t d = deadlines[i];
+	int child;
 
-	len = 0;
-	for (i = 0; i < nparams; ++i)
+	for (; i > 0 && deadlines[(i - 1) / 2].when > d.when; i = (i - 1) / 2)
+		deadlines[i] = deadlines[(i - 1) / 2];
+	for (; (child = 2 * i + 1) < ndeadlines; i = child)
 	{
-		strcpy(ptr->job + len, command[i].word);
-		len = strlen (ptr->job);
-		ptr->job[len] = ' ';
-		ptr->job[++len] = '\0';
+		if (child + 1 < ndeadlines && deadlines[child + 1].when < deadlines[child].when)
+			++child;
+		if (deadlines[child].when >= d.when)
+			break;
+		deadlines[i] = deadlines[child];
 	}
+	deadlines[i] = d;
+}
 
-	if (status == ST_RUNNING)
-		printf("[%d] %d\n", *njobs, ptr->pgid);
+/* Removes deadline i from heap */
+void removeDeadline(int i)
+{
+	deadlines[i] = deadlines[--ndeadlines];
+	if (i < ndeadlines)
+		fixDeadline(i);
+}
+
+/* Makes timerfd and SIGCHLD signalfd for the event loop. SIGCHLD is blocked from now on, so waits can watch it
+   together with the timer and captured pipes */
+int initEvents()
+{
+	sigset_t set;
 
+	if (timerfd != -1)
+		return 0;
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+	if ((timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1
+	    || (sigchldfd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC)) == -1)
+	{
+		nonfatalError(errno, "timerfd");
+		sigprocmask(SIG_UNBLOCK, &set, NULL);
+		if (timerfd != -1)
+			close(timerfd);
+		timerfd = -1;
+		return -1;
+	}
 	return 0;
 }
 
-/* Deletes done entry form jobs array */
-void deleteJob(job_t **jobs, int *njobs, int jobnum)
+/* Adds deadline delay microseconds from now for job key */
+int addDeadline(pid_t key, pid_t target, long long delay, int sig, long long killafter)
 {
-	int lastdone;
-	job_t *ptr;
+	deadline_t *ptr;
 
-	if ((*jobs)[jobnum].job != NULL)
-		free((*jobs)[jobnum].job);
-	(*jobs)[jobnum].job = NULL;
-	(*jobs)[jobnum].status = ST_NONE;
-	if (jobnum == *njobs - 1)
+	if (initEvents())
+		return -1;
+	if (ndeadlines == maxdeadlines)
 	{
-		lastdone = jobnum;
-		while (((*jobs)[lastdone].status == ST_NONE) && --lastdone >= 0);
-		if ((ptr = realloc(*jobs, (lastdone + 1) * sizeof(job_t))) == NULL && lastdone + 1 > 0)
-			return;
-		*jobs = ptr;
-		*njobs = lastdone + 1;
+		if ((ptr = realloc(deadlines, (maxdeadlines * 2 + PARAM_COUNT) * sizeof(deadline_t))) == NULL)
+			return nonfatalError(errno, NULL);
+		deadlines = ptr;
+		maxdeadlines = maxdeadlines * 2 + PARAM_COUNT;
 	}
+	deadlines[ndeadlines].when = traceTime() + delay;
+	deadlines[ndeadlines].killafter = killafter;
+	deadlines[ndeadlines].key = key;
+	deadlines[ndeadlines].target = target;
+	deadlines[ndeadlines].sig = sig;
+	fixDeadline(ndeadlines++);
+	if (deadlines[0].key == key)
+		armTimer();
+	return 0;
 }
 
-/* Frees jobs array */
-void clearJobs(job_t **jobs, int njobs)
+/* Removes deadlines of finished job */
+void cancelDeadlines(pid_t key)
 {
-	int i;
+	int i, removed = 0;
 
-	if (*jobs == NULL)
-		return;
-	for (i = 0; i < njobs; ++i)
-		if ((*jobs)[i].job != NULL)
-			free((*jobs)[i].job);
-	free(*jobs);
-	*jobs = NULL;
+	for (i = ndeadlines - 1; i >= 0; --i)
+		if (deadlines[i].key == key)
+		{
+			removeDeadline(i);
+			removed = 1;
+		}
+	if (removed)
+		armTimer();
 }
 
-/* Show current jobs status */
-void showJobs(job_t *jobs, int njobs, int fullog)
+/* Signals jobs whose deadlines have expired. Stopped jobs are continued to get the signal. When the job shares
+   process group with the shell, the shell ignores the signal meanwhile, or only the last pid gets signals it can't ignore */
+void runDeadlines()
 {
-	int i;
-	char status[8];
+	unsigned long long expirations;
+	long long now = traceTime();
+	void (*handler)(int);
+	deadline_t d;
 
-	for (i = 0; i < njobs; ++i)
+	read(timerfd, &expirations, sizeof(expirations));
+	while (ndeadlines > 0 && deadlines[0].when <= now)
 	{
-		if (jobs[i].status == ST_NONE || (!fullog && (jobs[i].status == ST_RUNNING || jobs[i].status == ST_STOPPED)))
-			continue;
-		switch (jobs[i].status)
+		d = deadlines[0];
+		removeDeadline(0);
+		traceEvent("deadline", (char *)sigabbrev_np(d.sig), now, -1, 0, d.key);
+		if (d.target != -getpgrp())
+			kill(d.target, d.sig);
+		else if (d.sig == SIGKILL || d.sig == SIGSTOP || d.sig == SIGCHLD)
+			kill(d.key, d.sig);
+		else
 		{
-			case ST_NONE:	 break;
-			case ST_DONE: 	 strcpy(status, "Done");	break;
-			case ST_RUNNING: strcpy(status, "Running"); break;
-			case ST_JUSTSTP: jobs[i].status = ST_STOPPED;
-			case ST_STOPPED: strcpy(status, "Stopped"); break;
+			handler = signal(d.sig, SIG_IGN);
+			kill(d.target, d.sig);
+			signal(d.sig, handler);
 		}
-		printf("[%d] %s\t\t%s\n", i + 1, status, jobs[i].job);
+		kill(d.target, SIGCONT);
+		expiredjob = d.key;
+		if (d.killafter > 0)
+			addDeadline(d.key, d.target, d.killafter, SIGKILL, 0);
 	}
+	armTimer();
 }
 
-/* Checks jobs statuses. fullog determines if all the jobs should be shown, or only the done and just stopped ones */
-void checkJobs(job_t **jobs, int *njobs)
+/* Makes capture for output of background job, its pipe write end is put into wfd. Returns NULL on error */
+capture_t *openCapture(int *wfd)
 {
-	int i, status;
-	pid_t pid;
-	job_t *job;
+	char dir[PATH_MAX], *tmp;
+	capture_t *cap, **ptr;
+	int fds[2];
 
-	for (i = 0; i < *njobs; ++i)
+	if (initEvents() || (cap = calloc(1, sizeof(capture_t))) == NULL)
+		return NULL;
+	cap->fd = cap->spillfd = -1;
+	cap->size = capturesize > 0 ? capturesize : CAPTURE_SIZE;
+	if (capturebg == 2)
 	{
-		job = *jobs + i;
-		if (job->status == ST_NONE)
-			continue;
-		while ((pid = waitpid (-job->pgid, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0)
-			if (WIFSTOPPED (status))
-				job->status = ST_JUSTSTP;
-			else if (WIFCONTINUED (status))
-				job->status = ST_RUNNING;
-		if (pid == -1)
-			job->status = ST_DONE;
+		snprintf(dir, PATH_MAX, "%s/xish-job-XXXXXX", (tmp = getenv("TMPDIR")) != NULL ? tmp : "/tmp");
+		if ((cap->spillfd = mkostemp(dir, O_CLOEXEC)) == -1)
+		{
+			nonfatalError(errno, dir);
+			releaseCapture(&cap);
+			return NULL;
+		}
+		unlink(dir);
+	}
+	if ((ptr = realloc(captures, (ncaptures + 1) * sizeof(capture_t *))) == NULL || pipe2(fds, O_CLOEXEC))
+	{
+		nonfatalError(errno, NULL);
+		if (ptr != NULL)
+			captures = ptr;
+		releaseCapture(&cap);
+		return NULL;
 	}
+	captures = ptr;
+	captures[ncaptures++] = cap;
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	cap->fd = fds[0];
+	*wfd = fds[1];
+	return cap;
 }
 
-/* Deletes done jobs from jobs array */
-void deleteDoneJobs(job_t **jobs, int *njobs)
+/* Stops watching pipe of the capture and closes it */
+void closeCapture(capture_t *cap)
 {
 	int i;
-	for (i = 0; i < *njobs; ++i)
-		if ((*jobs)[i].status == ST_DONE)
-			deleteJob (jobs, njobs, i);
+
+	if (cap->fd == -1)
+		return;
+	for (i = 0; i < ncaptures && captures[i] != cap; ++i);
+	if (i < ncaptures)
+		captures[i] = captures[--ncaptures];
+	close(cap->fd);
+	cap->fd = -1;
 }
 
-/* Return special sequence meaning */
-word_t charType(char ch, word_t prev)
+/* Frees capture of deleted job */
+void releaseCapture(capture_t **cap)
 {
-	if (ch == '>' && prev == WT_FILEWRTRUNC) return WT_FILEWRAPPEND;
-	if (ch == '|' && prev == WT_PIPE)		 return WT_OR;
-	if (ch == '&' && prev == WT_BACKGROUND)	 return WT_AND;
-	if (prev != 0) return WT_WORD;
-	if (ch == '>') return WT_FILEWRTRUNC;
-	if (ch == '<') return WT_FILERD;
-	if (ch == '&') return WT_BACKGROUND;
-	if (ch == '|') return WT_PIPE;
-	if (ch == '(') return WT_LBRACKET;
-	if (ch == ')') return WT_RBRACKET;
-	if (ch == ';') return WT_SEMICOLON;
-	return WT_WORD;
+	if (*cap == NULL)
+		return;
+	closeCapture(*cap);
+	if ((*cap)->spillfd != -1)
+		close((*cap)->spillfd);
+	free((*cap)->ring);
+	free(*cap);
+	*cap = NULL;
 }
 
-/* Replaces environmental variable with its value */
-int placeEnv(char **param, int *len, char *environmental)
+/* Reads what the job has written so far into its ring or spill file, and to stdout if the job is in foreground.
+   Reads straight into the ring, at most up to its end. Returns 0 at EOF, -1 if there is nothing to read */
+int drainCapture(capture_t *cap)
 {
-	char *env = getenv(environmental), *ptr;
-	int envlen;
-
-	if (env == NULL)
-		return 0;
-	envlen = strlen(env);
+	char buf[CAPTURE_SIZE], *data = buf;
+	ssize_t len;
 
-	if (addChar(param, len, '\0') == -1)
+	if (cap->spillfd == -1 && (cap->ring != NULL || (cap->ring = malloc(cap->size)) != NULL))
+	{
+		data = cap->ring + cap->total % cap->size;
+		len = read(cap->fd, data, cap->size - cap->total % cap->size);
+	}
+	else
+		len = read(cap->fd, buf, sizeof(buf));
+	if (len == -1 && (errno == EAGAIN || errno == EINTR))
 		return -1;
-	*len += envlen - 1;
+	if (len <= 0)
+	{
+		closeCapture(cap);
+		return 0;
+	}
+	if (cap->spillfd != -1)
+		write(cap->spillfd, buf, len);
+	cap->total += len;
+	if (cap->echo)
+	{
+		write(STDOUT_FILENO, data, len);
+		cap->shown = cap->total;
+	}
+	return len;
+}
+
+/* Reads everything the job has left in its pipe */
+void finishCapture(capture_t *cap)
+{
+	while (cap->fd != -1 && drainCapture(cap) > 0);
+}
+
+/* Returns captured byte at position pos */
+int captureByte(capture_t *cap, long long pos)
+{
+	char ch = '\n';
+
+	if (cap->spillfd == -1)
+		return cap->ring[pos % cap->size];
+	pread(cap->spillfd, &ch, 1, pos);
+	return ch;
+}
+
+/* Writes captured output from byte from on to out. Ring keeps only the last size bytes. Output that starts
+   in the middle of the line which wasn't shown yet starts from the next line */
+void showCapture(FILE *out, capture_t *cap, long long from)
+{
+	char buf[BUFSIZ];
+	long long pos, len;
+
+	if (cap->spillfd == -1 && from < cap->total - cap->size)
+		from = cap->total - cap->size;
+	if (from < 0)
+		from = 0;
+	if (from > 0 && from != cap->shown)
+		/* Byte before the ring is already overwritten */
+		for (pos = cap->spillfd == -1 ? from + 1 : from; pos < cap->total && pos - from < BUFSIZ; ++pos)
+			if (captureByte(cap, pos - 1) == '\n')
+			{
+				from = pos;
+				break;
+			}
+	for (pos = from; pos < cap->total; pos += len)
+		if (cap->spillfd != -1)
+		{
+			len = cap->total - pos < sizeof(buf) ? cap->total - pos : sizeof(buf);
+			if ((len = pread(cap->spillfd, buf, len, pos)) <= 0)
+				break;
+			fwrite(buf, 1, len, out);
+		}
+		else
+		{
+			len = cap->size - pos % cap->size;
+			if (len > cap->total - pos)
+				len = cap->total - pos;
+			fwrite(cap->ring + pos % cap->size, 1, len, out);
+		}
+	cap->shown = cap->total;
+}
+
+/* Waits for events of the shell: expired deadlines, SIGCHLD, output of background jobs and fd being readable.
+   Returns 1 if fd is readable, -1 on error */
+int waitEvents(int fd)
+{
+	struct signalfd_siginfo info;
+	struct pollfd *ptr;
+	int i;
+
+	if (maxpollfds < ncaptures + 3)
+	{
+		if ((ptr = realloc(pollfds, (ncaptures + 3) * sizeof(struct pollfd))) == NULL)
+			return nonfatalError(errno, NULL);
+		pollfds = ptr;
+		maxpollfds = ncaptures + 3;
+	}
+	pollfds[0].fd = timerfd;
+	pollfds[1].fd = sigchldfd;
+	pollfds[2].fd = fd;
+	for (i = 0; i < ncaptures; ++i)
+		pollfds[i + 3].fd = captures[i]->fd;
+	for (i = 0; i < ncaptures + 3; ++i)
+		pollfds[i].events = POLLIN;
+	if (poll(pollfds, ncaptures + 3, -1) == -1)
+		return errno == EINTR ? 0 : nonfatalError(errno, NULL);
+
+	while (read(sigchldfd, &info, sizeof(info)) > 0);
+	if (pollfds[0].revents & POLLIN)
+		runDeadlines();
+	/* Closed captures are replaced by the last ones, which are already done */
+	for (i = ncaptures - 1; i >= 0; --i)
+		if (pollfds[i + 3].revents)
+			drainCapture(captures[i]);
+	return pollfds[2].revents != 0;
+}
+
+/* wait4 that keeps serving deadlines and captured pipes while it waits */
+pid_t waitChild(pid_t pid, int *status, int options, struct rusage *usage)
+{
+	pid_t result;
+
+	while (ndeadlines > 0 || ncaptures > 0)
+	{
+		if ((result = wait4(pid, status, options | WNOHANG, usage)) != 0)
+			return result;
+		if (waitEvents(-1) == -1)
+			break;
+	}
+	return wait4(pid, status, options, usage);
+}
+
+/* Checks if in can be read without blocking. The fd is peeked with O_NONBLOCK, so input already buffered
+   by stdio is found without looking into FILE */
+int inputReady(FILE *in)
+{
+	int fd = fileno(in), flags, ch;
+
+	if ((flags = fcntl(fd, F_GETFL)) == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		return 1;
+	ch = getc(in);
+	fcntl(fd, F_SETFL, flags);
+	if (ch != EOF)
+	{
+		ungetc(ch, in);
+		return 1;
+	}
+	if (!ferror(in) || (errno != EAGAIN && errno != EWOULDBLOCK))
+		return 1;
+	clearerr(in);
+	return 0;
+}
+
+/* Waits until there is something to read in input, serving deadlines and output of background jobs meanwhile.
+   Scripts run from memory have no fd and never block */
+void waitInput(FILE *in)
+{
+	if (fileno(in) < 0)
+		return;
+	while ((ndeadlines > 0 || ncaptures > 0) && !inputReady(in))
+		if (waitEvents(fileno(in)) != 0)
+			return;
+}
+
+/* Adds new entry to jobs array, initializes the structure with given data */
+int addJob(job_t **jobs, int *njobs, param_t *command, int nparams, int pgid, status_t status)
+{
+	int len = nparams + 1, i;
+	job_t *ptr;
+
+	STAT_ADD(joballocs, 2);
+	if ((ptr = realloc(*jobs, (*njobs + 1) * sizeof(job_t))) == NULL)
+		return nonfatalError(errno, NULL);
+
+	*jobs = ptr;
+	ptr = *jobs + *njobs;
+	ptr->pgid = pgid;
+	ptr->status = status;
+	ptr->placement = describePlacement(command, nparams);
+	ptr->cgroup = NULL;
+	ptr->peak = -1;
+	ptr->capture = NULL;
+	++(*njobs);
+
+	for (i = 0; i < nparams; ++i)
+		len += strlen(command[i].word);
+	if ((ptr->job = calloc(len + 1, sizeof(char))) == NULL)
+		return nonfatalError(errno, NULL);
+
+	len = 0;
+	for (i = 0; i < nparams; ++i)
+	{
+		strcpy(ptr->job + len, command[i].word);
+		len = strlen (ptr->job);
+		ptr->job[len] = ' ';
+		ptr->job[++len] = '\0';
+	}
+
+	if (status == ST_RUNNING)
+		printf("[%d] %d\n", *njobs, ptr->pgid);
+
+	return 0;
+}
+
+/* Deletes done entry form jobs array */
+void deleteJob(job_t **jobs, int *njobs, int jobnum)
+{
+	int lastdone;
+	job_t *ptr;
+
+	if ((*jobs)[jobnum].job != NULL)
+		free((*jobs)[jobnum].job);
+	free((*jobs)[jobnum].placement);
+	releaseCgroup(&(*jobs)[jobnum].cgroup);
+	releaseCapture(&(*jobs)[jobnum].capture);
+	cancelDeadlines((*jobs)[jobnum].pgid);
+	releaseCoproc((*jobs)[jobnum].pgid);
+	(*jobs)[jobnum].job = NULL;
+	(*jobs)[jobnum].placement = NULL;
+	(*jobs)[jobnum].status = ST_NONE;
+	if (jobnum == *njobs - 1)
+	{
+		lastdone = jobnum;
+		while (((*jobs)[lastdone].status == ST_NONE) && --lastdone >= 0);
+		if ((ptr = realloc(*jobs, (lastdone + 1) * sizeof(job_t))) == NULL && lastdone + 1 > 0)
+			return;
+		*jobs = ptr;
+		*njobs = lastdone + 1;
+	}
+}
+
+/* Frees jobs array */
+void clearJobs(job_t **jobs, int njobs)
+{
+	int i;
+
+	if (*jobs == NULL)
+		return;
+	for (i = 0; i < njobs; ++i)
+	{
+		if ((*jobs)[i].job != NULL)
+			free((*jobs)[i].job);
+		free((*jobs)[i].placement);
+		releaseCgroup(&(*jobs)[i].cgroup);
+		releaseCapture(&(*jobs)[i].capture);
+	}
+	free(*jobs);
+	*jobs = NULL;
+}
+
+/* Writes size in bytes like 12.3M into buf */
+void formatSize(long long size, char *buf, int len)
+{
+	char *unit = "BKMGT";
+	double value = size;
+
+	while (value >= 1024 && unit[1])
+	{
+		value /= 1024;
+		++unit;
+	}
+	snprintf(buf, len, *unit == 'B' ? "%.0f%c" : "%.1f%c", value, *unit);
+}
+
+/* Show current jobs status. fullog 0 shows only done and just stopped jobs, 1 shows all the jobs,
+   2 shows all the jobs with their process groups and cpus. Done limited jobs show their peak memory,
+   done jobs with captured output show the output not shown yet */
+void showJobs(FILE *out, job_t *jobs, int njobs, int fullog)
+{
+	int i;
+	char status[8], peak[32];
+
+	for (i = 0; i < njobs; ++i)
+	{
+		if (jobs[i].status == ST_NONE || (!fullog && (jobs[i].status == ST_RUNNING || jobs[i].status == ST_STOPPED)))
+			continue;
+		switch (jobs[i].status)
+		{
+			case ST_NONE:	 break;
+			case ST_DONE: 	 strcpy(status, "Done");	break;
+			case ST_RUNNING: strcpy(status, "Running"); break;
+			case ST_JUSTSTP: jobs[i].status = ST_STOPPED;
+			case ST_STOPPED: strcpy(status, "Stopped"); break;
+		}
+		peak[0] = '\0';
+		if (jobs[i].status == ST_DONE && jobs[i].peak >= 0)
+		{
+			strcpy(peak, "\tpeak ");
+			formatSize(jobs[i].peak, peak + strlen(peak), sizeof(peak) - strlen(peak));
+		}
+		if (fullog == 2)
+			fprintf(out, "[%d] %d %s\t\t%s\t[cpu %s]%s\n", i + 1, jobs[i].pgid, status, jobs[i].job,
+			        jobs[i].placement != NULL ? jobs[i].placement : "any", peak);
+		else
+			fprintf(out, "[%d] %s\t\t%s%s\n", i + 1, status, jobs[i].job, peak);
+		if (jobs[i].status == ST_DONE && jobs[i].capture != NULL)
+			showCapture(out, jobs[i].capture, jobs[i].capture->shown);
+	}
+}
+
+long long cgroupPeak(char *);
+
+/* Checks jobs statuses. fullog determines if all the jobs should be shown, or only the done and just stopped ones */
+void checkJobs(job_t **jobs, int *njobs)
+{
+	int i, status, waits = 0;
+	long long peak;
+	struct rusage usage;
+	pid_t pid = 0;
+	job_t *job;
+
+	for (i = 0; i < *njobs; ++i)
+	{
+		job = *jobs + i;
+		if (job->status == ST_NONE)
+			continue;
+		while (1)
+		{
+			++waits;
+			if ((pid = wait4(-job->pgid, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) <= 0)
+				break;
+			if (WIFEXITED(status) || WIFSIGNALED(status))
+			{
+				traceEvent("reap", NULL, TRACE_NOW(), -1, pid, job->pgid);
+				if (job->peak >= 0 && usage.ru_maxrss * 1024LL > job->peak)
+					job->peak = usage.ru_maxrss * 1024LL;
+			}
+			else if (WIFSTOPPED (status))
+				job->status = ST_JUSTSTP;
+			else if (WIFCONTINUED (status))
+				job->status = ST_RUNNING;
+		}
+		if (pid == -1 && job->status != ST_DONE)
+		{
+			job->status = ST_DONE;
+			cancelDeadlines(job->pgid);
+			if (job->capture != NULL)
+				finishCapture(job->capture);
+			if (job->cgroup != NULL && (peak = cgroupPeak(job->cgroup)) >= 0)
+				job->peak = peak;
+		}
+	}
+	STAT_ADD(checkwaits, waits);
+}
+
+/* Deletes done jobs from jobs array */
+void deleteDoneJobs(job_t **jobs, int *njobs)
+{
+	int i;
+	for (i = 0; i < *njobs; ++i)
+		if ((*jobs)[i].status == ST_DONE)
+			deleteJob (jobs, njobs, i);
+}
+
+/* Return special sequence meaning */
+word_t charType(char ch, word_t prev)
+{
+	if (ch == '>' && prev == WT_FILEWRTRUNC) return WT_FILEWRAPPEND;
+	if (ch == '|' && prev == WT_PIPE)		 return WT_OR;
+	if (ch == '&' && prev == WT_BACKGROUND)	 return WT_AND;
+	if (ch == '&' && prev == WT_FILEWRTRUNC) return WT_DUPOUT;
+	if (ch == '&' && prev == WT_FILERD)		 return WT_DUPIN;
+	if (prev != 0) return WT_WORD;
+	if (ch == '>') return WT_FILEWRTRUNC;
+	if (ch == '<') return WT_FILERD;
+	if (ch == '&') return WT_BACKGROUND;
+	if (ch == '|') return WT_PIPE;
+	if (ch == '(') return WT_LBRACKET;
+	if (ch == ')') return WT_RBRACKET;
+	if (ch == ';') return WT_SEMICOLON;
+	return WT_WORD;
+}
+
+/* Sets some environmental variables for later use. Done once before the first command or variable needs them,
+   so the shell starts without touching /proc or the user database */
+void setEnvVars()
+{
+	char buf[PATH_MAX];
+	struct passwd *pw;
+	int len;
+
+	if (envready)
+		return;
+	envready = 1;
+	if ((len = readlink("/proc/self/exe", buf, PATH_MAX - 1)) != -1)
+	{
+		buf[len] = '\0';
+		setenv("SHELL", buf, 1);
+	}
+	sprintf(buf, "%d", geteuid());
+	setenv("EUID", buf, 1);
+	/* getlogin_r() needs utmp and a terminal, which containers and cron jobs don't have */
+	if (getenv("USER") == NULL && (pw = getpwuid(geteuid())) != NULL)
+		setenv("USER", pw->pw_name, 1);
+}
+
+/* Returns value of shell variable, or of environmental one if there is no such shell variable */
+char *getVar(char *name)
+{
+	var_t *var;
+
+	for (var = shellvars; var != NULL; var = var->next)
+		if (!strcmp(var->name, name))
+			return var->value;
+	return getenv(name);
+}
+
+/* Sets shell variable */
+int setVar(char *name, char *value)
+{
+	var_t *var;
+	char *copy;
+
+	for (var = shellvars; var != NULL && strcmp(var->name, name); var = var->next);
+	if ((copy = strdup(value)) == NULL)
+		return nonfatalError(errno, NULL);
+	if (var == NULL)
+	{
+		if ((var = malloc(sizeof(var_t))) == NULL || (var->name = strdup(name)) == NULL)
+		{
+			free(var);
+			free(copy);
+			return nonfatalError(errno, NULL);
+		}
+		var->next = shellvars;
+		shellvars = var;
+	}
+	else
+		free(var->value);
+	var->value = copy;
+	return 0;
+}
+
+/* Removes shell variable */
+void unsetVar(char *name)
+{
+	var_t **pvar, *var;
+
+	for (pvar = &shellvars; *pvar != NULL && strcmp((*pvar)->name, name); pvar = &(*pvar)->next);
+	if ((var = *pvar) == NULL)
+		return;
+	*pvar = var->next;
+	free(var->name);
+	free(var->value);
+	free(var);
+}
+
+/* Replaces variable with its value */
+int placeEnv(char **param, int *len, char *environmental)
+{
+	char *env, *ptr;
+	int envlen;
+
+	setEnvVars();
+	lexedvars = 1;
+	env = getVar(environmental);
+
+	if (env == NULL)
+		return 0;
+	envlen = strlen(env);
+
+	if (addChar(param, len, '\0') == -1)
+		return -1;
+	*len += envlen - 1;
 	if ((ptr = realloc(*param, ((*len / STR_SIZE + 1) * STR_SIZE) * sizeof(char))) == NULL)
 		return nonfatalError(errno, NULL);
 	*param = ptr;
-	strncpy(*param + *len - envlen, env, envlen);
+	memcpy(*param + *len - envlen, env, envlen);
 
 	return 0;
 }
 
-/* Removes everything in stdin until EOF or EOL */
-void flushStdin()
+/* Removes everything in input until EOF or EOL */
+void flushInput(FILE *in)
+{
+	int ch;
+	while ((ch = getc(in)) != '\n' && ch != EOF);
+}
+
+/* Shows continuation prompt when the command is typed by user */
+void showContPrompt(FILE *in)
 {
-	char ch;
-	while ((ch = getchar()) != '\n' && ch != EOF);
+	if (in == stdin && isinteractive)
+		printf(CONT_PROMPT);
 }
 
 /* Little macros to check for memory errors in readCommand() */
-#define MEMORYOP(a) if ((a) == -1) { flushStdin(); return RET_MEMORYERR; }
+#define MEMORYOP(a) if ((a) == -1) { flushInput(in); return RET_MEMORYERR; }
 
-/* Reads the infinite string and parses it into substrings array. Return statuses:
+/* Reads the infinite string and parses it into substrings array, counting read bytes in nbytes. Return statuses:
  * RET_OK  - command is correct
  * RET_EOF - EOF found
  * RET_MEMORYERR - memory allocation error
  */
-result_t readCommand(param_t **params, int *nparams)
+result_t lexCommand(FILE *in, param_t **params, int *nparams, long long *nbytes)
 {
-	enum { IN_WORD, IN_BETWEEN, IN_ESCAPE, IN_QUOTES, IN_SPECIAL, IN_ENV } state = IN_BETWEEN, previous;
+	enum { IN_WORD, IN_BETWEEN, IN_ESCAPE, IN_QUOTES, IN_SPECIAL, IN_ENV, IN_BRACE } state = IN_BETWEEN, previous;
 	int ch, len, type, envlen, bracketcnt = 0;
 	char *environmental = NULL;
 
@@ -327,9 +1281,12 @@ result_t readCommand(param_t **params, int *nparams)
 
 	while (1)
 	{
-		ch = getchar();
+		ch = getc(in);
 		if (ch == EOF)
 			return RET_EOF;
+		++*nbytes;
+		if (parsestart == 0)
+			parsestart = traceTime();
 
 		switch (state)
 		{
@@ -349,7 +1306,7 @@ result_t readCommand(param_t **params, int *nparams)
 				else if (ch == ')')
 					--bracketcnt;
 				if (ch == '\n' && bracketcnt > 0)
-					printf(CONT_PROMPT);
+					showContPrompt(in);
 				else if (ch == '\n')
 					return RET_OK;
 				else if (ch == '\\')
@@ -361,7 +1318,7 @@ result_t readCommand(param_t **params, int *nparams)
 				}
 				else if (ch == '#')
 				{
-					flushStdin();
+					flushInput(in);
 					return RET_OK;
 				}
 				else if (ch == '"')
@@ -396,10 +1353,34 @@ result_t readCommand(param_t **params, int *nparams)
 				}
 				break;
 
-			case IN_ENV:
-				if (isalnum(ch))
+			case IN_BRACE:
+				if (ch == '\n')
 				{
-					MEMORYOP(addChar(&environmental, &envlen, ch));
+					/* Unterminated ${ is dropped */
+					free(environmental);
+					MEMORYOP(endString(&(*params)[*nparams - 1].word, len));
+					return RET_OK;
+				}
+				if (ch != '}')
+				{
+					MEMORYOP(addChar(&environmental, &envlen, ch));
+					break;
+				}
+				state = IN_WORD;
+				MEMORYOP(endString(&environmental, envlen));
+				MEMORYOP(placeEnv(&(*params)[*nparams - 1].word, &len, environmental));
+				free(environmental);
+				break;
+
+			case IN_ENV:
+				if (ch == '{' && envlen == 0)
+				{
+					state = IN_BRACE;
+					break;
+				}
+				if (isalnum(ch) || ch == '_')
+				{
+					MEMORYOP(addChar(&environmental, &envlen, ch));
 					break;
 				}
 				state = IN_WORD;
@@ -413,7 +1394,7 @@ result_t readCommand(param_t **params, int *nparams)
 				else if (ch == ')')
 					--bracketcnt;
 				if (ch == '\n' && bracketcnt  > 0)
-					printf(CONT_PROMPT);
+					showContPrompt(in);
 				else if (ch == '\n')
 				{
 					MEMORYOP(endString(&(*params)[*nparams - 1].word, len));
@@ -426,7 +1407,7 @@ result_t readCommand(param_t **params, int *nparams)
 				}
 				else if (ch == '#')
 				{
-					flushStdin();
+					flushInput(in);
 					MEMORYOP(endString(&(*params)[*nparams - 1].word, len));
 					return RET_OK;
 				}
@@ -463,14 +1444,14 @@ result_t readCommand(param_t **params, int *nparams)
 			case IN_ESCAPE:
 				state = previous;
 				if (ch == '\n')
-					printf(CONT_PROMPT);
+					showContPrompt(in);
 				else
 					MEMORYOP(addChar(&(*params)[*nparams - 1].word, &len, ch));
 				break;
 
 			case IN_QUOTES:
 				if (ch == '\n')
-					printf(CONT_PROMPT);
+					showContPrompt(in);
 				if (ch == '\\')
 				{
 					previous = IN_QUOTES;
@@ -488,13 +1469,34 @@ result_t readCommand(param_t **params, int *nparams)
 	}
 }
 
+/* Waits for the input and reads one command, see lexCommand. Parse time is counted from the first read byte */
+result_t readCommand(FILE *in, param_t **params, int *nparams)
+{
+	long long nbytes = 0;
+	result_t result;
+
+	waitInput(in);
+	parsestart = 0;
+	result = lexCommand(in, params, nparams, &nbytes);
+	STAT_ADD(lexbytes, nbytes);
+	if (result == RET_OK)
+	{
+		STAT_ADD(lines, 1);
+		statTime(stats->parse, traceTime() - parsestart);
+	}
+	return result;
+}
+
 /* Checks if command is internal that must be executed in the main process */
 int isInternal(param_t *params, int nparams)
 {
 	int i;
 
 	if (params[0].type != WT_WORD || (strcmp(params[0].word, "cd") && strcmp(params[0].word, "exit")
-	    && strcmp(params[0].word, "jobs") && strcmp(params[0].word, "fg") && strcmp(params[0].word, "bg")))
+	    && strcmp(params[0].word, "jobs") && strcmp(params[0].word, "fg") && strcmp(params[0].word, "bg")
+	    && strcmp(params[0].word, "exec") && strcmp(params[0].word, "source") && strcmp(params[0].word, ".")
+	    && strcmp(params[0].word, "memo") && strcmp(params[0].word, "set") && strcmp(params[0].word, "ulimit")
+	    && strcmp(params[0].word, "coproc") && strcmp(params[0].word, "read") && strcmp(params[0].word, "xstat")))
 		return 0;
 	for (i = 1; i < nparams - 1; ++i)
 		if (params[i].type == WT_PIPE)
@@ -504,10 +1506,13 @@ int isInternal(param_t *params, int nparams)
 }
 
 /* Shifts process group of pid process to foreground and waits for all the processes
-   to finish. Returns 1 if the process was stopped and 0 if it has termeniated */
-int waitProcessGroup(pid_t lastpid, int pgid, int *status)
+   to finish. Returns 1 if the process was stopped and 0 if it has termeniated.
+   Exit status of killed process is 128 plus signal number. peak collects the largest ru_maxrss in bytes */
+int waitProcessGroup(pid_t lastpid, int pgid, int *status, long long *peak)
 {
-	int st, pidstatus = 0, tracemode = 0;
+	int st = 0, pidstatus = 0, tracemode = 0;
+	long long begin = traceTime();
+	struct rusage usage;
 	pid_t pid;
 	if (!issubshell)
 		tracemode = WUNTRACED;
@@ -515,16 +1520,23 @@ int waitProcessGroup(pid_t lastpid, int pgid, int *status)
 	if (!issubshell)
 		tcsetpgrp(STDIN_FILENO, pgid);
 	kill (-pgid, SIGCONT);
-	while ((pid = waitpid(-pgid, &st, tracemode)) != (pid_t)-1 && !WIFSTOPPED(st))
+	while ((pid = waitChild(-pgid, &st, tracemode, &usage)) != (pid_t)-1 && !WIFSTOPPED(st))
+	{
+		traceEvent("reap", NULL, TRACE_NOW(), -1, pid, pgid);
+		if (peak != NULL && usage.ru_maxrss * 1024LL > *peak)
+			*peak = usage.ru_maxrss * 1024LL;
 		if (pid == lastpid)
 			pidstatus = st;
+	}
+	traceSpan("wait", NULL, begin);
+	statTime(stats->wait, traceTime() - begin);
 	if (!issubshell)
 		tcsetpgrp(STDIN_FILENO, getpid ());
 
 	if (WIFSTOPPED(st))
 		putchar('\n');
 	if (status != NULL && !WIFSTOPPED(st))
-		*status = WEXITSTATUS(pidstatus);
+		*status = WIFSIGNALED(pidstatus) ? 128 + WTERMSIG(pidstatus) : WEXITSTATUS(pidstatus);
 
 	return WIFSTOPPED(st);
 }
@@ -547,54 +1559,859 @@ int findDivider(param_t *params, int nparams, int begin, word_t div1, word_t div
 	return divider;
 }
 
+/* Parses cpu list like 0-3,8 into set. Returns -1 if the list is wrong */
+int parseCpuList(char *list, cpu_set_t *set)
+{
+	long first, last;
+	char *end;
+
+	CPU_ZERO(set);
+	while (*list)
+	{
+		first = last = strtol(list, &end, 10);
+		if (end == list)
+			return -1;
+		if (*end == '-')
+		{
+			list = end + 1;
+			last = strtol(list, &end, 10);
+			if (end == list)
+				return -1;
+		}
+		if (first < 0 || last < first || last >= CPU_SETSIZE || (*end != ',' && *end != '\0'))
+			return -1;
+		for (; first <= last; ++first)
+			CPU_SET(first, set);
+		list = *end == ',' ? end + 1 : end;
+	}
+	return 0;
+}
+
+/* Writes set into buf as cpu list like 0-3,8 */
+void formatCpuList(cpu_set_t *set, char *buf, int size)
+{
+	int cpu, last, len = 0;
+
+	buf[0] = '\0';
+	for (cpu = 0; cpu < CPU_SETSIZE && len < size; ++cpu)
+	{
+		if (!CPU_ISSET(cpu, set))
+			continue;
+		for (last = cpu; last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set); ++last);
+		len += snprintf(buf + len, size - len, last == cpu ? "%s%d" : "%s%d-%d", len ? "," : "", cpu, last);
+		cpu = last;
+	}
+}
+
+/* Chooses cpus for pipeline stage number stage of nstages. @cpu= prefix of the stage wins over pipeline-affinity
+   option: spread puts stages evenly over allowed cpus, compact puts them on neighbouring ones, both starting from
+   affinitybase. Single commands are left to the scheduler. Returns 0 if the stage is not pinned, -1 for invalid cpu list */
+int stageCpus(param_t *params, int nparams, int stage, int nstages, cpu_set_t *set)
+{
+	cpu_set_t allowed;
+	int cpu, n, target;
+
+	if (nparams > 0 && params[0].type == WT_WORD && !strncmp(params[0].word, CPU_PREFIX, strlen(CPU_PREFIX)))
+		return parseCpuList(params[0].word + strlen(CPU_PREFIX), set) ? -1 : 1;
+	if (pipelineaffinity == AF_NONE || nstages == 1 || sched_getaffinity(0, sizeof(allowed), &allowed))
+		return 0;
+
+	n = CPU_COUNT(&allowed);
+	target = ((pipelineaffinity == AF_SPREAD ? (long)stage * n / nstages : stage) + affinitybase) % n;
+	CPU_ZERO(set);
+	for (cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+		if (CPU_ISSET(cpu, &allowed) && target-- == 0)
+		{
+			CPU_SET(cpu, set);
+			break;
+		}
+	return 1;
+}
+
+/* Makes memory of the NUMA node of the first cpu in set preferred for the process */
+void preferCpuNode(cpu_set_t *set)
+{
+#ifdef SYS_set_mempolicy
+	char path[64];
+	unsigned long mask;
+	struct dirent *ent;
+	int cpu, node = -1;
+	DIR *d;
+
+	for (cpu = 0; cpu < CPU_SETSIZE && !CPU_ISSET(cpu, set); ++cpu);
+	sprintf(path, "/sys/devices/system/cpu/cpu%d", cpu);
+	if ((d = opendir(path)) == NULL)
+		return;
+	while ((ent = readdir(d)) != NULL && node == -1)
+		if (!strncmp(ent->d_name, "node", 4) && isdigit(ent->d_name[4]))
+			node = atoi(ent->d_name + 4);
+	closedir(d);
+	if (node < 0 || node >= sizeof(mask) * CHAR_BIT)
+		return;
+	mask = 1UL << node;
+	syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, sizeof(mask) * CHAR_BIT);
+#endif
+}
+
+/* Pins current process to the cpus chosen for the stage */
+void placeStage(param_t *params, int nparams, int stage, int nstages)
+{
+	cpu_set_t set;
+
+	switch (stageCpus(params, nparams, stage, nstages, &set))
+	{
+	case 0:
+		return;
+	case -1:
+		nonfatalError(EINVAL, params[0].word);
+		return;
+	}
+	if (sched_setaffinity(0, sizeof(set), &set))
+		nonfatalError(errno, params[0].word);
+	else
+		preferCpuNode(&set);
+}
+
+/* Counts pipeline stages */
+int countStages(param_t *params, int nparams)
+{
+	int begin, nstages = 0;
+
+	for (begin = 0; begin < nparams; begin = findDivider(params, nparams, begin, WT_PIPE, WT_PIPE) + 1)
+		++nstages;
+	return nstages;
+}
+
+/* Returns description of cpus of job stages like "0 | - | 2-3", or NULL if no stage is pinned */
+char *describePlacement(param_t *params, int nparams)
+{
+	char buf[256], cpus[64];
+	int begin, divider, stage = 0, nstages = countStages(params, nparams), len = 0, pinned = 0;
+	cpu_set_t set;
+
+	for (begin = 0; begin < nparams && len < sizeof(buf); begin = divider + 1, ++stage)
+	{
+		divider = findDivider(params, nparams, begin, WT_PIPE, WT_PIPE);
+		strcpy(cpus, "-");
+		if (stageCpus(params + begin, divider - begin, stage, nstages, &set) > 0)
+		{
+			formatCpuList(&set, cpus, sizeof(cpus));
+			pinned = 1;
+		}
+		len += snprintf(buf + len, sizeof(buf) - len, "%s%s", stage ? " | " : "", cpus);
+	}
+	return pinned ? strdup(buf) : NULL;
+}
+
+/* Parses size like 512K, 2G or 100 into bytes. Returns -1 if the size is wrong */
+long long parseSize(char *s)
+{
+	long long size;
+	char *end;
+
+	size = strtoll(s, &end, 10);
+	if (end == s || size < 0)
+		return -1;
+	switch (toupper(*end))
+	{
+		case 'G': size <<= 10;
+		case 'M': size <<= 10;
+		case 'K': size <<= 10; ++end;
+		case '\0': break;
+		default:  return -1;
+	}
+	return *end ? -1 : size;
+}
+
+/* Writes str into file, returns -1 on error */
+int writeFile(char *path, char *str)
+{
+	int fd, len = strlen(str);
+
+	if ((fd = open(path, O_WRONLY | O_CLOEXEC)) == -1)
+		return -1;
+	if (write(fd, str, len) != len)
+	{
+		close(fd);
+		return -1;
+	}
+	return close(fd);
+}
+
+/* Puts delegated cgroup v2 directory where job cgroups are made into dir. Only XISH_CGROUP is used: the shell's own
+   cgroup has processes in it, and cgroup v2 doesn't enable controllers for children of such a cgroup.
+   Returns -1 if there is no delegated cgroup */
+int cgroupBase(char *dir)
+{
+	char *env;
+
+	if ((env = getenv("XISH_CGROUP")) == NULL || *env == '\0')
+		return -1;
+	return snprintf(dir, PATH_MAX, "%s", env) < PATH_MAX ? 0 : -1;
+}
+
+/* Turns limit setting into cgroup file and its value: cpu=N% is share of one cpu, mem=SIZE is memory size,
+   controller.file=value is written as is. Returns -1 for unknown setting */
+int limitSetting(char *word, char *file, char *value, long long *mem)
+{
+	char *eq = strchr(word, '='), *end;
+	long share;
+
+	if (!strncmp(word, "cpu=", 4))
+	{
+		share = strtol(word + 4, &end, 10);
+		if (end == word + 4 || share <= 0 || strcmp(end, "%"))
+			return -1;
+		strcpy(file, "cpu.max");
+		sprintf(value, "%ld %d", share * CPU_PERIOD / 100, CPU_PERIOD);
+	}
+	else if (!strncmp(word, "mem=", 4))
+	{
+		if ((*mem = parseSize(word + 4)) == -1)
+			return -1;
+		strcpy(file, "memory.max");
+		sprintf(value, "%lld", *mem);
+	}
+	else if (memchr(word, '.', eq - word) != NULL && eq - word < NAME_MAX && strlen(eq + 1) < STR_SIZE)
+	{
+		sprintf(file, "%.*s", (int)(eq - word), word);
+		strcpy(value, eq + 1);
+	}
+	else
+		return -1;
+	return 0;
+}
+
+/* Writes value into file of cgroup leaf. If there is no such file, enables its controller for children of base */
+int writeCgroup(char *base, char *leaf, char *file, char *value)
+{
+	char path[PATH_MAX], controller[NAME_MAX + 2];
+
+	snprintf(path, PATH_MAX, "%s/%s", leaf, file);
+	if (access(path, F_OK))
+	{
+		snprintf(controller, sizeof(controller), "+%.*s", (int)strcspn(file, "."), file);
+		snprintf(path, PATH_MAX, "%s/cgroup.subtree_control", base);
+		writeFile(path, controller);
+		snprintf(path, PATH_MAX, "%s/%s", leaf, file);
+	}
+	return writeFile(path, value);
+}
+
+/* Removes cgroup of done job and frees its path */
+void releaseCgroup(char **cgroup)
+{
+	if (*cgroup == NULL)
+		return;
+	rmdir(*cgroup);
+	free(*cgroup);
+	*cgroup = NULL;
+}
+
+/* Reads peak memory usage of cgroup, returns -1 if it is unknown */
+long long cgroupPeak(char *cgroup)
+{
+	char path[PATH_MAX];
+	long long peak = -1;
+	FILE *f;
+
+	snprintf(path, PATH_MAX, "%s/memory.peak", cgroup);
+	if ((f = fopen(path, "r")) == NULL)
+		return -1;
+	if (fscanf(f, "%lld", &peak) != 1)
+		peak = -1;
+	fclose(f);
+	return peak;
+}
+
+/* Shows peak memory of limited job done after fg: memory.peak of its cgroup, or the largest ru_maxrss */
+void showPeak(char *cgroup, long long peak)
+{
+	char size[32];
+	long long cgpeak;
+
+	if (cgroup != NULL && (cgpeak = cgroupPeak(cgroup)) >= 0)
+		peak = cgpeak;
+	formatSize(peak, size, sizeof(size));
+	fprintf(stderr, "peak %s\n", size);
+}
+
+/* Parses limit prefix: limit setting... command. Makes cgroup v2 leaf for the job when there is a delegated one,
+   otherwise memory is limited with rlimit and other settings are ignored. Returns number of prefix words or -1 */
+int prepareLimit(param_t *params, int nparams, limit_t *limit)
+{
+	char base[PATH_MAX], path[PATH_MAX], file[NAME_MAX + 1], value[STR_SIZE];
+	int i, n;
+
+	limit->active = 1;
+	for (n = 1; n < nparams && params[n].type == WT_WORD && strchr(params[n].word, '=') != NULL; ++n)
+		if (limitSetting(params[n].word, file, value, &limit->mem))
+			return nonfatalError(EINVAL, params[n].word);
+	if (n == 1 || n == nparams)
+		return nonfatalError(0, "usage: limit [cpu=N%] [mem=SIZE] [controller.file=value]... command");
+
+	if (cgroupBase(base) == 0)
+	{
+		if (snprintf(path, PATH_MAX, "%s/xish-%d-%d", base, getpid(), ++limitseq) < PATH_MAX && mkdir(path, 0755) == 0)
+		{
+			limit->cgroup = strdup(path);
+			for (i = 1; i < n && limitSetting(params[i].word, file, value, &limit->mem) == 0
+			     && writeCgroup(base, path, file, value) == 0; ++i);
+			if (i == n && limit->cgroup != NULL)
+				return n;
+			releaseCgroup(&limit->cgroup);
+		}
+	}
+	for (i = 1; i < n; ++i)
+		if (strncmp(params[i].word, "mem=", 4))
+			error(0, 0, "%s: no delegated cgroup v2, ignored", params[i].word);
+	return n;
+}
+
+/* Parses duration like 1.5, 30s, 2m, 1h or 1d into microseconds. Returns -1 if it is wrong */
+long long parseDuration(char *s)
+{
+	double value;
+	char *end;
+
+	value = strtod(s, &end);
+	if (end == s || value < 0)
+		return -1;
+	switch (*end)
+	{
+		case 'd': value *= 24;
+		case 'h': value *= 60;
+		case 'm': value *= 60;
+		case 's': ++end;
+		case '\0': break;
+		default:  return -1;
+	}
+	return *end ? -1 : (long long)(value * 1000000);
+}
+
+/* Parses signal name like TERM, SIGTERM or number. Returns -1 if it is wrong */
+int parseSignal(char *s)
+{
+	const char *name;
+	char *end;
+	int sig;
+
+	if (isdigit(*s))
+	{
+		sig = strtol(s, &end, 10);
+		return *end || sig <= 0 || sig >= NSIG ? -1 : sig;
+	}
+	if (!strncmp(s, "SIG", 3))
+		s += 3;
+	for (sig = 1; sig < NSIG; ++sig)
+		if ((name = sigabbrev_np(sig)) != NULL && !strcmp(name, s))
+			return sig;
+	return -1;
+}
+
+/* Parses timeout prefix: timeout [-s SIG] [-k KILL_AFTER] DURATION command. Returns number of prefix words or -1 */
+int prepareTimeout(param_t *params, int nparams, deadline_t *timeout)
+{
+	int n = 1;
+
+	timeout->sig = SIGTERM;
+	timeout->killafter = 0;
+	for (; n + 1 < nparams && params[n].type == WT_WORD && params[n].word[0] == '-'; n += 2)
+		if (!strcmp(params[n].word, "-s") && (timeout->sig = parseSignal(params[n + 1].word)) != -1)
+			continue;
+		else if (!strcmp(params[n].word, "-k") && (timeout->killafter = parseDuration(params[n + 1].word)) != -1)
+			continue;
+		else if (strcmp(params[n].word, "-s") && strcmp(params[n].word, "-k"))
+		{
+			error(0, 0, "timeout: %s: unknown option", params[n].word);
+			return nonfatalError(0, "usage: timeout [-s SIG] [-k KILL_AFTER] DURATION command");
+		}
+		else
+			return nonfatalError(EINVAL, params[n + 1].word);
+	if (n + 1 >= nparams || params[n].type != WT_WORD || (timeout->when = parseDuration(params[n].word)) == -1)
+		return nonfatalError(0, "usage: timeout [-s SIG] [-k KILL_AFTER] DURATION command");
+	return n + 1;
+}
+
+/* Parses limit and timeout prefixes of the job. Returns number of prefix words or -1 */
+int jobPrefixes(param_t *params, int nparams, limit_t *limit, deadline_t *timeout)
+{
+	int skip = 0, n;
+
+	limit->cgroup = NULL;
+	limit->mem = -1;
+	limit->active = 0;
+	timeout->when = 0;
+	timeout->sig = SIGTERM;
+	timeout->killafter = 0;
+	while (skip < nparams && params[skip].type == WT_WORD)
+	{
+		if (!strcmp(params[skip].word, "limit") && !limit->active)
+			n = prepareLimit(params + skip, nparams - skip, limit);
+		else if (!strcmp(params[skip].word, "timeout") && timeout->when == 0)
+			n = prepareTimeout(params + skip, nparams - skip, timeout);
+		else
+			break;
+		if (n == -1)
+		{
+			releaseCgroup(&limit->cgroup);
+			return -1;
+		}
+		skip += n;
+	}
+	return skip;
+}
+
+/* Moves current process into the job cgroup, or limits its memory when there is no cgroup */
+void applyLimit(limit_t *limit)
+{
+	char path[PATH_MAX];
+	struct rlimit rl;
+
+	if (!limit->active)
+		return;
+	if (limit->cgroup != NULL)
+	{
+		snprintf(path, PATH_MAX, "%s/cgroup.procs", limit->cgroup);
+		if (writeFile(path, "0"))
+			nonfatalError(errno, path);
+	}
+	else if (limit->mem != -1)
+	{
+		rl.rlim_cur = rl.rlim_max = limit->mem;
+		if (setrlimit(RLIMIT_AS, &rl))
+			nonfatalError(errno, "limit");
+	}
+}
+
 /* For recursion */
 int launchJobs(param_t *, int, job_t **, int *);
+int internalSource(param_t *, int, job_t **, int *);
+int internalMemo(param_t *, int, job_t **, int *);
+int internalSet(param_t *, int);
+int internalUlimit(param_t *, int);
+int internalCoproc(param_t *, int, job_t **, int *);
+unsigned long long hashBytes(unsigned long long, void *, size_t);
+int internalRead(param_t *, int);
+void runStage(param_t *, int, int, int, job_t *, int);
+
+/* Shows captured output of job number num */
+int showJobOutput(FILE *out, job_t *jobs, int njobs, char *num)
+{
+	int n = atoi(num) - 1;
+
+	if (n < 0 || n >= njobs || jobs[n].status == ST_NONE)
+		return nonfatalError(0, "no such job");
+	if (jobs[n].capture == NULL)
+		return nonfatalError(0, "job output is not captured");
+	showCapture(out, jobs[n].capture, 0);
+	return 0;
+}
+
+/* Runs builtin that doesn't need the shell process and writes its output to out.
+   Returns exit status, or -1 if the command is not such builtin */
+int runBuiltin(FILE *out, param_t *params, int nparams, job_t *jobs, int njobs)
+{
+	char *s;
+
+	if (params[0].type != WT_WORD)
+		return -1;
+	if (!strcmp(params[0].word, "xstat"))
+	{
+		if (nparams > 1 && !strcmp(params[1].word, "-r"))
+			memset(stats, 0, sizeof(stats_t));
+		else
+			showStats(out);
+		return 0;
+	}
+	if (!strcmp(params[0].word, "cd") || !strcmp(params[0].word, "exit")
+	    || !strcmp(params[0].word, "fg") || !strcmp(params[0].word, "bg"))
+		return 0;
+	if (!strcmp(params[0].word, "jobs") && nparams > 2 && !strcmp(params[1].word, "-o"))
+		return showJobOutput(out, jobs, njobs, params[2].word) ? 1 : 0;
+	if (!strcmp(params[0].word, "jobs"))
+	{
+		showJobs(out, jobs, njobs, nparams > 1 && !strcmp(params[1].word, "-l") ? 2 : 1);
+		return 0;
+	}
+	if (!strcmp(params[0].word, "battlefield"))
+	{
+		fputs("Hi guys, TheWorldsEnd here!\n", out);
+		return 0;
+	}
+	if (!strcmp(params[0].word, "pwd"))
+	{
+		if ((s = getcwd(NULL, 0)) == NULL)
+		{
+			nonfatalError(errno, "pwd");
+			return 1;
+		}
+		fprintf(out, "%s\n", s);
+		free(s);
+		return 0;
+	}
+	return -1;
+}
+
+/* Runs builtin pipeline stage inside the shell and writes its whole output into the pipe, so no process is forked.
+   Done only when the output fits into the empty pipe and the write can't block. Its stderr goes to errfd unless it is -1,
+   like stderr of forked stages goes to the job's capture. Returns -1 if the stage has to be forked */
+int runBuiltinStage(param_t *params, int nparams, job_t *jobs, int njobs, int fd, int errfd)
+{
+	char *buf = NULL;
+	size_t len = 0;
+	int i, size, result, savestderr = -1;
+	FILE *out;
+
+	for (i = 0; i < nparams; ++i)
+		if (params[i].type != WT_WORD)
+			return -1;
+	if ((out = open_memstream(&buf, &len)) == NULL)
+		return -1;
+	if (errfd != -1 && (savestderr = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0)) != -1)
+		dup2(errfd, STDERR_FILENO);
+	result = runBuiltin(out, params, nparams, jobs, njobs);
+	if (savestderr != -1)
+	{
+		dup2(savestderr, STDERR_FILENO);
+		close(savestderr);
+	}
+	fclose(out);
+	if (result == -1 || (len > PIPE_BUF && ((size = fcntl(fd, F_GETPIPE_SZ)) == -1 || len > size)))
+	{
+		free(buf);
+		return -1;
+	}
+	if (len > 0)
+		write(fd, buf, len);
+	free(buf);
+	STAT_ADD(builtins, 1);
+	return 0;
+}
+
+/* Counts failed exec in PATH directory dir of len bytes. Its slot is claimed by the hash of the name,
+   so processes sharing the statistics agree on it without a lock */
+void countDirFailure(char *dir, int len)
+{
+	unsigned long long hash = hashBytes(14695981039346656037ULL, dir, len) | 1, old;
+	int i = hash % (STATS_DIRS - 1), n;
+
+	for (n = 0; n < STATS_DIRS - 1; ++n, i = (i + 1) % (STATS_DIRS - 1))
+	{
+		old = 0;
+		if (__atomic_compare_exchange_n(&stats->dirhashes[i], &old, hash, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		{
+			snprintf(stats->dirnames[i], STATS_DIRLEN, "%.*s", len, dir);
+			break;
+		}
+		if (old == hash)
+			break;
+	}
+	STAT_ADD(dirfails[n < STATS_DIRS - 1 ? i : STATS_DIRS - 1], 1);
+}
+
+/* execvp that counts failures. Command without a slash is tried in each PATH directory in turn, like execvp does,
+   and every directory it fails in is counted */
+void execCommand(char **argv)
+{
+	char path[PATH_MAX], *dir, *end;
+	int eacces = 0, len;
+
+	if (strchr(argv[0], '/') != NULL || (dir = getenv("PATH")) == NULL)
+	{
+		execvp(argv[0], argv);
+		STAT_ADD(execfails, 1);
+		return;
+	}
+	for (; ; dir = end + 1)
+	{
+		end = strchrnul(dir, ':');
+		len = end - dir;
+		if (snprintf(path, PATH_MAX, "%.*s%s%s", len, dir, len ? "/" : "", argv[0]) < PATH_MAX)
+		{
+			execv(path, argv);
+			if (errno == ENOEXEC) /* Script without #!, execvp runs it with sh */
+				execvp(path, argv);
+			countDirFailure(len ? dir : ".", len ? len : 1);
+			if (errno == EACCES)
+				eacces = 1;
+			else if (errno != ENOENT && errno != ENOTDIR && errno != ESTALE && errno != ENAMETOOLONG)
+				break;
+		}
+		if (*end == '\0')
+		{
+			errno = eacces ? EACCES : errno;
+			break;
+		}
+	}
+	STAT_ADD(execfails, 1);
+}
+
+/* Returns the number of bytes exec takes for words of params with their pointers. Redirection targets aren't passed */
+long long argSize(param_t *params, int nparams)
+{
+	long long size = 0;
+	int i;
+
+	for (i = 0; i < nparams; ++i)
+		if (IS_FILEOP(params[i].type))
+			++i;
+		else if (params[i].type == WT_WORD)
+			size += strlen(params[i].word) + 1 + sizeof(char *);
+	return size;
+}
+
+/* Returns space left for arguments by ARG_MAX after the environment, with some headroom like xargs keeps */
+long long argLimit()
+{
+	long long size = sysconf(_SC_ARG_MAX) - ARG_HEADROOM;
+	char **env;
+
+	for (env = environ; *env != NULL; ++env)
+		size -= strlen(*env) + 1 + sizeof(char *);
+	return size;
+}
+
+/* Checks before fork that every stage of the pipeline can be exec'ed. Stages run by batch prefix or autosplit
+   only need every argument to fit into the kernel limit of one string. Returns -1 if the arguments are too long */
+int checkArgs(param_t *params, int nparams)
+{
+	long long maxlen = 32 * sysconf(_SC_PAGESIZE), limit = -1;
+	int begin, divider, i;
+
+	for (begin = 0; begin < nparams; begin = divider + 1)
+	{
+		divider = findDivider(params, nparams, begin, WT_PIPE, WT_PIPE);
+		if (params[begin].type != WT_WORD)
+			continue;
+		for (i = begin; i < divider; ++i)
+			if (params[i].type == WT_WORD && strlen(params[i].word) >= maxlen)
+				return nonfatalError(E2BIG, params[begin].word);
+		for (i = begin; i < divider - 1 && params[i + 1].type == WT_WORD && (!strncmp(params[i].word, CPU_PREFIX, strlen(CPU_PREFIX))
+		     || !strcmp(params[i].word, "exec")); ++i);
+		if (autosplit || !strcmp(params[i].word, "batch"))
+			continue;
+		if (limit == -1)
+			limit = argLimit();
+		if (argSize(params + begin, divider - begin) > limit)
+			return nonfatalError(E2BIG, params[begin].word);
+	}
+	return 0;
+}
+
+/* Turns words of params into NULL terminated argv in place, so the words are neither copied nor allocated.
+   param_t takes at least two pointers, so argv fits into the first half of params: argv[i] is written over
+   params[i / 2], whose word has already been read, and argv[nparams] still lies inside params */
+char **paramsArgv(param_t *params, int nparams)
+{
+	char **argv = (char **)params;
+	int i;
+
+	_Static_assert(sizeof(param_t) >= 2 * sizeof(char *), "argv doesn't fit into params");
+	for (i = 0; i < nparams; ++i)
+		argv[i] = params[i].word;
+	argv[nparams] = NULL;
+	return argv;
+}
+
+/* Waits for one of running chunks of runBatches and removes it from pids and fds. Pidfds of the chunks are polled,
+   so other children of the shell are left alone. Chunk without pidfd is waited for directly.
+   Returns 1 if the chunk has failed */
+int waitChunk(pid_t *pids, struct pollfd *fds, int *running)
+{
+	int i, status = 0;
+
+	for (i = 0; i < *running && fds[i].fd != -1; ++i);
+	if (i == *running)
+	{
+		while (poll(fds, *running, -1) == -1 && errno == EINTR);
+		for (i = 0; i < *running && !fds[i].revents; ++i);
+		if (i == *running)
+			i = 0;
+	}
+	while (waitpid(pids[i], &status, 0) == -1 && errno == EINTR);
+	if (fds[i].fd != -1)
+		close(fds[i].fd);
+	--*running;
+	pids[i] = pids[*running];
+	fds[i] = fds[*running];
+	return !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+/* Runs command of argv over chunks of its arguments that fit into ARG_MAX, up to nprocs at once like xargs -P.
+   The command name and its leading options are repeated in every chunk, and they are put right before the chunk
+   in argv, so chunks aren't copied. With nprocs > 1 arguments are spread over at least nprocs chunks.
+   Returns 0 if all the chunks have succeeded, 123 if some has failed and -1 if chunks can't be started */
+int runBatches(char **argv, int argc, int nprocs)
+{
+	char **fixed, **hidden, *saved;
+	long long limit = argLimit(), total = 0, size;
+	int nfixed = 1, begin, end, running = 0, failed = 0, result = 0;
+	struct pollfd *fds;
+	pid_t pid, *pids;
+
+	while (nfixed < argc && argv[nfixed][0] == '-' && strcmp(argv[nfixed++], "--"));
+	fixed = malloc(nfixed * sizeof(char *));
+	hidden = malloc(nfixed * sizeof(char *));
+	pids = malloc(nprocs * sizeof(pid_t));
+	fds = malloc(nprocs * sizeof(struct pollfd));
+	if (fixed == NULL || hidden == NULL || pids == NULL || fds == NULL)
+	{
+		nonfatalError(errno, NULL);
+		free(fixed);
+		free(hidden);
+		free(pids);
+		free(fds);
+		return -1;
+	}
+	memcpy(fixed, argv, nfixed * sizeof(char *));
+	for (begin = 0; begin < argc; ++begin)
+		if (begin < nfixed)
+			limit -= strlen(argv[begin]) + 1 + sizeof(char *);
+		else
+			total += strlen(argv[begin]) + 1 + sizeof(char *);
+	if (nprocs > 1 && total / nprocs < limit)
+		limit = total / nprocs + 1;
+
+	begin = nfixed;
+	do
+	{
+		for (end = begin, size = 0; end < argc && (end == begin || size + strlen(argv[end]) + 1 + sizeof(char *) <= limit); ++end)
+			size += strlen(argv[end]) + 1 + sizeof(char *);
+		/* Words of the previous chunk under the fixed ones are put back after fork, so argv stays whole */
+		memcpy(hidden, argv + begin - nfixed, nfixed * sizeof(char *));
+		memcpy(argv + begin - nfixed, fixed, nfixed * sizeof(char *));
+		saved = argv[end];
+		argv[end] = NULL;
+		if (running == nprocs)
+			failed |= waitChunk(pids, fds, &running);
+		if ((pid = fork()) == -1)
+		{
+			result = nonfatalError(errno, fixed[0]);
+			memcpy(argv + begin - nfixed, hidden, nfixed * sizeof(char *));
+			argv[end] = saved;
+			break;
+		}
+		if (!pid)
+		{
+			initChild();
+			STAT_ADD(execs, 1);
+			execCommand(argv + begin - nfixed);
+			error(-1, errno, fixed[0]);
+		}
+		pids[running] = pid;
+#ifdef SYS_pidfd_open
+		fds[running].fd = syscall(SYS_pidfd_open, pid, 0);
+#else
+		fds[running].fd = -1;
+#endif
+		fds[running++].events = POLLIN;
+		memcpy(argv + begin - nfixed, hidden, nfixed * sizeof(char *));
+		argv[end] = saved;
+		begin = end;
+	}
+	while (begin < argc);
+	while (running > 0)
+		failed |= waitChunk(pids, fds, &running);
+	free(fixed);
+	free(hidden);
+	free(pids);
+	free(fds);
+	return result == -1 ? -1 : failed ? 123 : 0;
+}
+
+/* batch prefix: batch [-P N] command [argument]... runs command over chunks of arguments by runBatches,
+   -P 0 runs as many chunks at once as there are online cpus */
+int internalBatch(param_t *params, int nparams)
+{
+	int nprocs = 1, skip = 1;
+	char *end;
+
+	if (nparams > 2 && !strcmp(params[1].word, "-P"))
+	{
+		nprocs = strtol(params[2].word, &end, 10);
+		if (*end || end == params[2].word || nprocs < 0)
+			nprocs = -1;
+		else if (nprocs == 0)
+			nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+		skip = 3;
+	}
+	if (nprocs < 1 || skip >= nparams)
+		return nonfatalError(0, "usage: batch [-P N] command [argument]...");
+	return runBatches(paramsArgv(params + skip, nparams - skip), nparams - skip, nprocs);
+}
 
 /* Executes a straightforward params (no pipes, no dividers - just params with parameters) */
 void executeCommand(param_t *params, int nparams, job_t *jobs, int njobs)
 {
 	char **command;
 	int i;
+	sigset_t set;
+	long long begin = TRACE_NOW();
 
 	signal(SIGINT,  SIG_DFL);
 	signal(SIGTSTP, SIG_DFL);
 	signal(SIGTTOU, SIG_DFL);
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	sigprocmask(SIG_UNBLOCK, &set, NULL);
+
+	while (params[0].type == WT_WORD && !strncmp(params[0].word, CPU_PREFIX, strlen(CPU_PREFIX))) /* Applied by runStage */
+	{
+		if (nparams == 1)
+			exit(0);
+		++params;
+		--nparams;
+	}
+
+	if (params[0].type == WT_WORD && !strcmp(params[0].word, "exec")) /* Process is already ours */
+	{
+		if (nparams == 1)
+			exit(0);
+		++params;
+		--nparams;
+	}
+
+	if (params[0].type == WT_WORD && !strcmp(params[0].word, "batch"))
+		exit(internalBatch(params, nparams));
 
 	if (params[0].type == WT_LBRACKET) /* Launching subshell */
 	{
 		issubshell = 1;
-		exit(launchJobs(params + 1, nparams - 2, &jobs, &njobs));
+		tailexec = 1;
+		i = launchJobs(params + 1, nparams - 2, &jobs, &njobs);
+		traceSpan("subshell", NULL, begin);
+		exit(i);
 	}
 
-	if (!strcmp(params[0].word, "cd") || !strcmp(params[0].word, "exit")
-	    || !strcmp(params[0].word, "fg") || !strcmp(params[0].word, "bg"))
-		exit(0);
-	if (!strcmp(params[0].word, "jobs"))
-	{
-		showJobs(jobs, njobs, 1);
-		exit(0);
-	}
-	if (!strcmp(params[0].word, "battlefield"))
-	{
-		puts("Hi guys, TheWorldsEnd here!");
-		exit(0);
-	}
-	if (!strcmp(params[0].word, "pwd"))
+	if ((i = runBuiltin(stdout, params, nparams, jobs, njobs)) != -1)
 	{
-		char *s = getcwd(NULL, 0);
-		if (s == NULL)
-			fatalError();
-		puts(s);
-		free(s);
-		exit(0);
+		STAT_ADD(builtins, 1);
+		traceSpan("builtin", params[0].word, begin);
+		exit(i);
 	}
+	if (isInternal(params, nparams))
+		STAT_ADD(builtins, 1);
+	if (!strcmp(params[0].word, "source") || !strcmp(params[0].word, "."))
+		exit(internalSource(params, nparams, &jobs, &njobs));
+	if (!strcmp(params[0].word, "memo"))
+		exit(internalMemo(params, nparams, &jobs, &njobs));
+	if (!strcmp(params[0].word, "set"))
+		exit(internalSet(params, nparams));
+	if (!strcmp(params[0].word, "ulimit"))
+		exit(internalUlimit(params, nparams));
+	if (!strcmp(params[0].word, "coproc"))
+		exit(internalCoproc(params, nparams, &jobs, &njobs));
+	if (!strcmp(params[0].word, "read"))
+		exit(internalRead(params, nparams));
 
-	if ((command = malloc((nparams + 1) * sizeof(char *))) == NULL)
-		fatalError();
-	for (i = 0; i < nparams; ++i)
-		command[i] = params[i].word;
-	command[nparams] = NULL;
-	execvp(command[0], command);
+	if (autosplit && argSize(params, nparams) > argLimit())
+		exit(runBatches(paramsArgv(params, nparams), nparams, 1));
+	command = paramsArgv(params, nparams);
+	traceEvent("exec", command[0], TRACE_NOW(), -1, 0, 0);
+	traceFlush();
+	STAT_ADD(execs, 1);
+	execCommand(command);
 	error(-1, errno, command[0]);
 }
 
@@ -626,6 +2443,20 @@ param_t *removeRedirectors(param_t *params, int nparams, int *count)
 	return command;
 }
 
+/* Dups descriptor given by its number, for >& and <& */
+int dupFd(char *word)
+{
+	char *end;
+	long fd = strtol(word, &end, 10);
+
+	if (end == word || *end || fd < 0 || fd > INT_MAX)
+	{
+		errno = EBADF;
+		return -1;
+	}
+	return dup(fd);
+}
+
 /* Dups files from params to stdin and stdout, return 1 is there was at least one redirection */
 int dupFiles(param_t *params, int nparams)
 {
@@ -649,6 +2480,16 @@ int dupFiles(param_t *params, int nparams)
 				if ((in = open(params[i + 1].word, O_RDONLY)) == -1)
 					return nonfatalError(errno, params[i + 1].word);
 			}
+			else if (out == STDOUT_FILENO && params[i].type == WT_DUPOUT)
+			{
+				if ((out = dupFd(params[i + 1].word)) == -1)
+					return nonfatalError(errno, params[i + 1].word);
+			}
+			else if (in == STDIN_FILENO && params[i].type == WT_DUPIN)
+			{
+				if ((in = dupFd(params[i + 1].word)) == -1)
+					return nonfatalError(errno, params[i + 1].word);
+			}
 			--i;
 		}
 		else if (params[i].type == WT_LBRACKET)
@@ -675,20 +2516,27 @@ int internalChangeDir(param_t *params, int nparams)
 	return 0;
 }
 
-/* jobs internal command */
+/* jobs internal command. jobs -o N shows captured output of job N */
 int internalJobs(param_t *params, int nparams, job_t **jobs, int *njobs)
 {
+	int i;
+
 	if (issubshell)
 		return nonfatalError(0, "jobs: no job control");
+	for (i = 0; i < ncaptures; ++i)
+		while (drainCapture(captures[i]) > 0);
+	if (nparams > 2 && !strcmp(params[1].word, "-o"))
+		return showJobOutput(stdout, *jobs, *njobs, params[2].word);
 	checkJobs(jobs, njobs);
-	showJobs(*jobs, *njobs, 1);
+	showJobs(stdout, *jobs, *njobs, nparams > 1 && !strcmp(params[1].word, "-l") ? 2 : 1);
 	deleteDoneJobs(jobs, njobs);
 	return 0;
 }
 
-/* fg internal command */
+/* fg internal command. Job with captured output replays its tail, then its output is copied to stdout */
 int internalForeground(param_t *params, int nparams, job_t **jobs, int *njobs)
 {
+	capture_t *cap;
 	int n;
 	if (issubshell)
 		return nonfatalError(0, "fg: no job control");
@@ -700,10 +2548,27 @@ int internalForeground(param_t *params, int nparams, job_t **jobs, int *njobs)
 	if (n < 0 || n >= *njobs)
 		return nonfatalError(0, "no such job");
 
-	if (waitProcessGroup(0, (*jobs)[n].pgid, NULL))
+	if ((cap = (*jobs)[n].capture) != NULL)
+	{
+		finishCapture(cap);
+		showCapture(stdout, cap, cap->total - cap->size);
+		fflush(stdout);
+		cap->echo = 1;
+	}
+	if (waitProcessGroup(0, (*jobs)[n].pgid, NULL, (*jobs)[n].peak >= 0 ? &(*jobs)[n].peak : NULL))
+	{
 		(*jobs)[n].status = ST_JUSTSTP;
+		if (cap != NULL)
+			cap->echo = 0;
+	}
 	else
+	{
+		if (cap != NULL)
+			finishCapture(cap);
+		if ((*jobs)[n].peak >= 0)
+			showPeak((*jobs)[n].cgroup, (*jobs)[n].peak);
 		deleteJob(jobs, njobs, n);
+	}
 
 	return 0;
 }
@@ -731,13 +2596,643 @@ int internalBackground(param_t *params, int nparams, job_t **jobs, int *njobs)
 	return 0;
 }
 
+/* set internal command: set -o shows options, set -o name[=value] changes one, set +o name turns it off */
+int internalSet(param_t *params, int nparams)
+{
+	option_t *opt;
+	char *value, *end;
+	int i, len;
+
+	if (nparams == 1 || (nparams == 2 && !strcmp(params[1].word, "-o")))
+	{
+		for (opt = options; opt->name != NULL; ++opt)
+			if (opt->choices != NULL)
+				printf("%s\t%s\n", opt->name, opt->choices[*opt->value]);
+			else
+				printf("%s\t%d\n", opt->name, *opt->value);
+		return 0;
+	}
+	if (nparams != 3 || (strcmp(params[1].word, "-o") && strcmp(params[1].word, "+o")))
+		return nonfatalError(0, "usage: set [-o name[=value]] [+o name]");
+
+	value = strchr(params[2].word, '=');
+	len = value != NULL ? value - params[2].word : strlen(params[2].word);
+	for (opt = options; opt->name != NULL && (strncmp(opt->name, params[2].word, len) || opt->name[len]); ++opt);
+	if (opt->name == NULL)
+		return nonfatalError(0, "set: no such option");
+
+	/* Numeric option has no default to turn on, and +o sets it to 0 */
+	if (opt->choices == NULL && params[1].word[0] == '-' && value == NULL)
+		return nonfatalError(0, "usage: set -o name=N");
+	if (opt->choices == NULL && params[1].word[0] == '+' && opt->min > 0)
+		return nonfatalError(0, "set: option can't be turned off");
+	if (params[1].word[0] == '+' || value == NULL)
+	{
+		*opt->value = params[1].word[0] == '-';
+		return 0;
+	}
+	if (opt->choices != NULL)
+	{
+		for (i = 0; opt->choices[i] != NULL && strcmp(opt->choices[i], value + 1); ++i);
+		if (opt->choices[i] == NULL)
+			return nonfatalError(0, "set: wrong option value");
+		*opt->value = i;
+		return 0;
+	}
+	i = strtol(value + 1, &end, 10);
+	if (*end || end == value + 1 || i < opt->min)
+		return nonfatalError(0, "set: wrong option value");
+	*opt->value = i;
+	return 0;
+}
+
+/* ulimit internal command: ulimit [-H|-S] [-a|-c|-d|-f|-l|-n|-s|-t|-u|-v] [limit]. New limit changes
+   both soft and hard ones unless -H or -S is given, shown is the soft one */
+int internalUlimit(param_t *params, int nparams)
+{
+	ulimit_t *lim = ulimits + 2, *p;
+	struct rlimit rl;
+	int i, hard = 0, soft = 0, all = 0;
+	unsigned long long n;
+	rlim_t value;
+	char *c, *end;
+
+	for (i = 1; i < nparams && params[i].word[0] == '-' && params[i].word[1]; ++i)
+		for (c = params[i].word + 1; *c; ++c)
+			if (*c == 'H')
+				hard = 1;
+			else if (*c == 'S')
+				soft = 1;
+			else if (*c == 'a')
+				all = 1;
+			else
+			{
+				for (lim = ulimits; lim->flag && lim->flag != *c; ++lim);
+				if (!lim->flag)
+					return nonfatalError(0, "usage: ulimit [-H|-S] [-a|-c|-d|-f|-l|-n|-s|-t|-u|-v] [limit]");
+			}
+
+	if (i == nparams)
+	{
+		for (p = all ? ulimits : lim; p->flag; ++p)
+		{
+			if (getrlimit(p->resource, &rl))
+				return nonfatalError(errno, "ulimit");
+			value = hard ? rl.rlim_max : rl.rlim_cur;
+			if (all)
+				printf("%-28s(-%c) ", p->name, p->flag);
+			if (value == RLIM_INFINITY)
+				puts("unlimited");
+			else
+				printf("%llu\n", (unsigned long long)value / p->unit);
+			if (!all)
+				break;
+		}
+		return 0;
+	}
+	if (all || i != nparams - 1)
+		return nonfatalError(0, "usage: ulimit [-H|-S] [-a|-c|-d|-f|-l|-n|-s|-t|-u|-v] [limit]");
+
+	if (!strcmp(params[i].word, "unlimited"))
+		value = RLIM_INFINITY;
+	else
+	{
+		errno = 0;
+		n = strtoull(params[i].word, &end, 10);
+		if (*end || end == params[i].word || !isdigit(params[i].word[0]))
+			return nonfatalError(EINVAL, params[i].word);
+		if (errno == ERANGE || n >= RLIM_INFINITY / lim->unit)
+			return nonfatalError(ERANGE, params[i].word);
+		value = n * lim->unit;
+	}
+	if (getrlimit(lim->resource, &rl))
+		return nonfatalError(errno, "ulimit");
+	if (hard || !soft)
+		rl.rlim_max = value;
+	if (soft || !hard)
+		rl.rlim_cur = value;
+	if (setrlimit(lim->resource, &rl))
+		return nonfatalError(errno, "ulimit");
+	return 0;
+}
+
+/* Checks if word is coprocess name: capitals, digits and underscores */
+int isCoprocName(char *word)
+{
+	if (!isupper(*word) && *word != '_')
+		return 0;
+	while (isupper(*word) || isdigit(*word) || *word == '_')
+		++word;
+	return *word == '\0';
+}
+
+/* Moves descriptor of the shell end of coprocess pipe out of the way of redirections */
+int moveFd(int fd)
+{
+	int newfd = fcntl(fd, F_DUPFD_CLOEXEC, COPROC_FD);
+
+	close(fd);
+	return newfd;
+}
+
+/* Reaps coprocesses that have exited, waiting for them up to ms milliseconds. Returns number of running ones */
+int reapCoprocs(int ms)
+{
+	pid_t pid;
+	int i;
+
+	while (1)
+	{
+		for (i = ncoprocs - 1; i >= 0; --i)
+		{
+			while ((pid = waitpid(-coprocs[i].pid, NULL, WNOHANG)) > 0);
+			if (pid == -1)
+				coprocs[i] = coprocs[--ncoprocs];
+		}
+		if (ncoprocs == 0 || ms-- <= 0)
+			return ncoprocs;
+		usleep(1000);
+	}
+}
+
+/* Closes pipes of coprocesses when the shell exits, so they get EOF. Ones still running after COPROC_GRACE
+   milliseconds get SIGTERM, then SIGKILL */
+void closeCoprocs()
+{
+	int i;
+
+	if (coprocowner != getpid())
+		return;
+	for (i = 0; i < ncoprocs; ++i)
+	{
+		close(coprocs[i].fds[0]);
+		close(coprocs[i].fds[1]);
+	}
+	if (reapCoprocs(COPROC_GRACE) == 0)
+		return;
+	for (i = 0; i < ncoprocs; ++i)
+	{
+		kill(-coprocs[i].pid, SIGTERM);
+		kill(-coprocs[i].pid, SIGCONT);
+	}
+	if (reapCoprocs(COPROC_GRACE) == 0)
+		return;
+	for (i = 0; i < ncoprocs; ++i)
+		kill(-coprocs[i].pid, SIGKILL);
+	reapCoprocs(COPROC_GRACE);
+}
+
+/* Returns 1 if command in params names descriptor fd in read -u fd or in a >& or <& redirection */
+int namesFd(param_t *params, int nparams, int fd)
+{
+	char num[16];
+	int i;
+
+	sprintf(num, "%d", fd);
+	if (nparams > 2 && !strcmp(params[0].word, "read") && !strcmp(params[1].word, "-u") && !strcmp(params[2].word, num))
+		return 1;
+	for (i = 1; i < nparams - 1; ++i)
+		if ((params[i].type == WT_DUPOUT || params[i].type == WT_DUPIN) && !strcmp(params[i + 1].word, num))
+			return 1;
+	return 0;
+}
+
+/* Closes shell ends of coprocess pipes in a child once its redirections are done, so coprocesses get EOF
+   when the shell closes them. Subshells keep them, commands keep the ones they name (read -u, >&, <&).
+   params are the ones before the redirections are removed */
+void dropCoprocs(param_t *params, int nparams)
+{
+	int i, j;
+
+	if (params[0].type == WT_LBRACKET)
+		return;
+	for (i = 0; i < ncoprocs; ++i)
+		for (j = 0; j < 2; ++j)
+			if (!namesFd(params, nparams, coprocs[i].fds[j]))
+				close(coprocs[i].fds[j]);
+	ncoprocs = 0;
+}
+
+/* Closes pipes of done coprocess job and removes its variables */
+void releaseCoproc(pid_t pid)
+{
+	char var[STR_SIZE];
+	int i;
+
+	for (i = 0; i < ncoprocs && coprocs[i].pid != pid; ++i);
+	if (i == ncoprocs)
+		return;
+	close(coprocs[i].fds[0]);
+	close(coprocs[i].fds[1]);
+	snprintf(var, STR_SIZE, "%s[0]", coprocs[i].name);
+	unsetVar(var);
+	snprintf(var, STR_SIZE, "%s[1]", coprocs[i].name);
+	unsetVar(var);
+	snprintf(var, STR_SIZE, "%s_PID", coprocs[i].name);
+	unsetVar(var);
+	free(coprocs[i].name);
+	coprocs[i] = coprocs[--ncoprocs];
+}
+
+/* coproc internal command: coproc [NAME] command. Runs background job with stdin and stdout connected to pipes,
+   the shell reads its output from ${NAME[0]} and writes its input to ${NAME[1]}, its pid is $NAME_PID.
+   NAME is COPROC by default, word in capitals followed by a command is taken as the name */
+int internalCoproc(param_t *params, int nparams, job_t **jobs, int *njobs)
+{
+	char *name = "COPROC", var[STR_SIZE], num[16];
+	int begin = 1, in[2], out[2], i;
+	coproc_t *ptr;
+	pid_t pid;
+
+	if (nparams > 2 && params[1].type == WT_WORD && isCoprocName(params[1].word) && strlen(params[1].word) < STR_SIZE - 8)
+	{
+		name = params[1].word;
+		begin = 2;
+	}
+	if (issubshell)
+		return nonfatalError(0, "coproc: no job control");
+	if (begin >= nparams)
+		return nonfatalError(0, "usage: coproc [NAME] command");
+	for (i = 0; i < ncoprocs && strcmp(coprocs[i].name, name); ++i);
+	if (i < ncoprocs)
+	{
+		error(0, 0, "%s: coprocess is already running", name);
+		return -1;
+	}
+	if ((ptr = realloc(coprocs, (ncoprocs + 1) * sizeof(coproc_t))) == NULL)
+		return nonfatalError(errno, NULL);
+	coprocs = ptr;
+	if (pipe(in))
+		return nonfatalError(errno, NULL);
+	if (pipe(out))
+	{
+		close(in[0]);
+		close(in[1]);
+		return nonfatalError(errno, NULL);
+	}
+
+	setEnvVars();
+	fflush(stdout);
+	if ((pid = fork()) == -1)
+	{
+		close(in[0]);
+		close(in[1]);
+		close(out[0]);
+		close(out[1]);
+		return nonfatalError(errno, NULL);
+	}
+	if (!pid)
+	{
+		initChild();
+		setpgid(0, 0);
+		dup2(in[0], STDIN_FILENO);
+		dup2(out[1], STDOUT_FILENO);
+		close(in[0]);
+		close(in[1]);
+		close(out[0]);
+		close(out[1]);
+		issubshell = 1;
+		tailexec = 1;
+		exit(launchJobs(params + begin, nparams - begin, jobs, njobs));
+	}
+	setpgid(pid, pid);
+	close(in[0]);
+	close(out[1]);
+
+	ptr = coprocs + ncoprocs++;
+	ptr->pid = pid;
+	ptr->fds[0] = moveFd(out[0]);
+	ptr->fds[1] = moveFd(in[1]);
+	ptr->name = strdup(name);
+	if (coprocowner != getpid())
+	{
+		coprocowner = getpid();
+		atexit(closeCoprocs);
+	}
+
+	for (i = 0; i < 2; ++i)
+	{
+		snprintf(var, STR_SIZE, "%s[%d]", name, i);
+		sprintf(num, "%d", ptr->fds[i]);
+		setVar(var, num);
+	}
+	snprintf(var, STR_SIZE, "%s_PID", name);
+	sprintf(num, "%d", pid);
+	setVar(var, num);
+	return addJob(jobs, njobs, params, nparams, pid, ST_RUNNING);
+}
+
+/* read internal command: read [-u fd] name... Reads one line from fd (stdin by default) byte by byte, so nothing
+   after the line is consumed. Words of the line go into shell variables, the last one gets the rest of the line.
+   Returns 1 at the end of file */
+int internalRead(param_t *params, int nparams)
+{
+	char *line = NULL, *word, *end, ch;
+	int fd = STDIN_FILENO, len = 0, i = 1;
+	ssize_t n;
+
+	if (nparams > 2 && !strcmp(params[1].word, "-u"))
+	{
+		fd = strtol(params[2].word, &end, 10);
+		if (*end || end == params[2].word)
+			return nonfatalError(EBADF, params[2].word);
+		i = 3;
+	}
+	if (i >= nparams)
+		return nonfatalError(0, "usage: read [-u fd] name...");
+
+	while ((n = read(fd, &ch, 1)) == 1 && ch != '\n')
+		if (addChar(&line, &len, ch) == -1)
+			return -1;
+	if (n == -1)
+	{
+		free(line);
+		return nonfatalError(errno, "read");
+	}
+	if (endString(&line, len) == -1)
+		return -1;
+
+	for (word = line; i < nparams; ++i)
+	{
+		while (isspace(*word))
+			++word;
+		if (i == nparams - 1)
+			for (end = word + strlen(word); end > word && isspace(end[-1]); --end);
+		else
+			for (end = word; *end && !isspace(*end); ++end);
+		ch = *end;
+		*end = '\0';
+		setVar(params[i].word, word);
+		word = ch != '\0' ? end + 1 : end;
+	}
+	free(line);
+	return n == 0 && len == 0;
+}
+
+/* Adds data to FNV-1a hash */
+unsigned long long hashBytes(unsigned long long hash, void *data, size_t len)
+{
+	unsigned char *p = data;
+
+	while (len-- > 0)
+		hash = (hash ^ *p++) * 1099511628211ULL;
+	return hash;
+}
+
+/* Puts memo cache directory path into dir and creates it if necessary */
+int memoDir(char *dir)
+{
+	char *base = getenv("XDG_CACHE_HOME"), *p;
+
+	if (base != NULL && *base)
+		snprintf(dir, PATH_MAX, "%s/xish/memo", base);
+	else if ((base = getenv("HOME")) != NULL)
+		snprintf(dir, PATH_MAX, "%s/.cache/xish/memo", base);
+	else
+		return nonfatalError(0, "memo: no cache directory");
+	for (p = dir + 1; (p = strchr(p, '/')) != NULL; ++p)
+	{
+		*p = '\0';
+		mkdir(dir, 0700);
+		*p = '/';
+	}
+	if (mkdir(dir, 0700) && errno != EEXIST)
+		return nonfatalError(errno, dir);
+	return 0;
+}
+
+/* Copies the rest of file from offset to stdout, in kernel when possible */
+int replayFile(int fd, off_t offset, off_t size)
+{
+	char buf[BUFSIZ];
+	ssize_t n = 0;
+
+	while (offset < size)
+	{
+		if ((n = copy_file_range(fd, &offset, STDOUT_FILENO, NULL, size - offset, 0)) > 0)
+			continue;
+		if (n == 0) /* Entry has been truncated or evicted by another shell */
+			break;
+		if ((n = sendfile(STDOUT_FILENO, fd, &offset, size - offset)) > 0)
+			continue;
+		if (n == 0 || (n = pread(fd, buf, sizeof(buf), offset)) <= 0 || write(STDOUT_FILENO, buf, n) != n)
+			break;
+		offset += n;
+	}
+	return offset < size ? -1 : 0;
+}
+
+/* Compares memo entries by last use */
+int compareMemo(const void *a, const void *b)
+{
+	const memo_t *x = a, *y = b;
+	return x->used < y->used ? -1 : x->used > y->used;
+}
+
+/* Collects cache entries, removes least recently used ones while the cache is bigger than XISH_MEMO_SIZE.
+   Total size and entries count are returned via size and count */
+void evictMemo(char *dir, long long *size, int *count)
+{
+	char *limit = getenv("XISH_MEMO_SIZE"), path[PATH_MAX];
+	long long max = limit != NULL ? atoll(limit) : MEMO_SIZE;
+	memo_t *entries = NULL, *ptr;
+	struct dirent *ent;
+	struct stat st;
+	int n = 0, i;
+	DIR *d;
+
+	*size = 0;
+	*count = 0;
+	if ((d = opendir(dir)) == NULL)
+		return;
+	while ((ent = readdir(d)) != NULL)
+	{
+		if (strlen(ent->d_name) != 16 || fstatat(dirfd(d), ent->d_name, &st, 0))
+			continue;
+		if ((ptr = realloc(entries, (n + 1) * sizeof(memo_t))) == NULL)
+			break;
+		entries = ptr;
+		strcpy(entries[n].name, ent->d_name);
+		entries[n].used = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+		entries[n++].size = st.st_size;
+		*size += st.st_size;
+	}
+	closedir(d);
+
+	qsort(entries, n, sizeof(memo_t), compareMemo);
+	for (i = 0; i < n && *size > max; ++i)
+	{
+		snprintf(path, PATH_MAX, "%s/%s", dir, entries[i].name);
+		if (unlink(path) == 0)
+		{
+			*size -= entries[i].size;
+			++memoevictions;
+		}
+	}
+	*count = n - i;
+	free(entries);
+}
+
+/* Runs command with stdout going to fd, returns its exit status */
+int runMemoCommand(param_t *params, int nparams, job_t **jobs, int *njobs, int fd)
+{
+	int status = -1;
+	pid_t pid;
+
+	if ((pid = fork()) == -1)
+		return nonfatalError(errno, NULL);
+	if (!pid)
+	{
+		initChild();
+		setpgid(0, 0);
+		dup2(fd, STDOUT_FILENO);
+		close(fd);
+		runStage(params, nparams, 0, 1, *jobs, *njobs);
+	}
+	setpgid(pid, pid);
+	if (waitProcessGroup(pid, pid, &status, NULL))
+	{
+		addJob(jobs, njobs, params, nparams, pid, ST_JUSTSTP);
+		return -1;
+	}
+	return status;
+}
+
+/* Adds one tagged part to memo key */
+void addMemoKey(FILE *key, char tag, void *data, size_t len)
+{
+	putc(tag, key);
+	fwrite(data, 1, len, key);
+}
+
+/* Checks that memo entry fd was stored for key, so entries with colliding hashes are never replayed */
+int memoKeyMatches(int fd, char *key, int keylen)
+{
+	int header[2], result;
+	char *stored;
+
+	if (pread(fd, header, sizeof(header), 0) != sizeof(header) || header[1] != keylen
+	    || (stored = malloc(keylen)) == NULL)
+		return 0;
+	result = pread(fd, stored, keylen, sizeof(header)) == keylen && !memcmp(stored, key, keylen);
+	free(stored);
+	return result;
+}
+
+/* memo internal command: memo [--key-file file]... [--env var]... command [args].
+   Output and exit status of the command are cached, the key is made of the command, current directory,
+   given variables and identity of given files. Entry starts with exit status and the whole key, its name is
+   the hash of the key. Cache hit replays the output without forking */
+int internalMemo(param_t *params, int nparams, job_t **jobs, int *njobs)
+{
+	char dir[PATH_MAX], path[PATH_MAX], tmp[PATH_MAX], *cwd, *value, *key = NULL;
+	unsigned long long hash;
+	long long size;
+	size_t keylen = 0;
+	struct stat st;
+	int i, fd, status, count, header[2];
+	FILE *keyf;
+
+	if (memoDir(dir))
+		return -1;
+	if (nparams == 2 && !strcmp(params[1].word, "--stats"))
+	{
+		evictMemo(dir, &size, &count);
+		printf("%d hits, %d misses, %d evictions, %d entries, %lld bytes\n", memohits, memomisses, memoevictions,
+		       count, size);
+		return 0;
+	}
+
+	if ((keyf = open_memstream(&key, &keylen)) == NULL)
+		return nonfatalError(errno, NULL);
+	for (i = 1; i < nparams - 1 && !strncmp(params[i].word, "--", 2); i += 2)
+		if (!strcmp(params[i].word, "--key-file"))
+		{
+			if (stat(params[i + 1].word, &st))
+				memset(&st, 0, sizeof(st));
+			addMemoKey(keyf, 'f', params[i + 1].word, strlen(params[i + 1].word) + 1);
+			fwrite(&st.st_dev, sizeof(st.st_dev), 1, keyf);
+			fwrite(&st.st_ino, sizeof(st.st_ino), 1, keyf);
+			fwrite(&st.st_mtim, sizeof(st.st_mtim), 1, keyf);
+			fwrite(&st.st_size, sizeof(st.st_size), 1, keyf);
+		}
+		else if (!strcmp(params[i].word, "--env"))
+		{
+			value = getenv(params[i + 1].word);
+			addMemoKey(keyf, value != NULL ? 'e' : 'u', params[i + 1].word, strlen(params[i + 1].word) + 1);
+			if (value != NULL)
+				fwrite(value, 1, strlen(value) + 1, keyf);
+		}
+		else
+			break;
+	if ((cwd = getcwd(NULL, 0)) != NULL)
+	{
+		addMemoKey(keyf, 'c', cwd, strlen(cwd) + 1);
+		free(cwd);
+	}
+	for (count = i; count < nparams; ++count)
+		addMemoKey(keyf, 'a', params[count].word, strlen(params[count].word) + 1);
+	fclose(keyf);
+	if (i >= nparams || !strncmp(params[i].word, "--", 2))
+	{
+		free(key);
+		return nonfatalError(0, "usage: memo [--key-file file]... [--env var]... command [args]");
+	}
+	hash = hashBytes(14695981039346656037ULL, key, keylen);
+	if (snprintf(path, PATH_MAX, "%s/%016llx", dir, hash) >= PATH_MAX
+	    || snprintf(tmp, PATH_MAX, "%s/tmp.%d", dir, getpid()) >= PATH_MAX)
+	{
+		free(key);
+		return nonfatalError(ENAMETOOLONG, dir);
+	}
+
+	fflush(stdout);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) != -1)
+	{
+		if (fstat(fd, &st) == 0 && memoKeyMatches(fd, key, keylen) && pread(fd, &status, sizeof(int), 0) == sizeof(int))
+		{
+			++memohits;
+			futimens(fd, NULL);
+			replayFile(fd, sizeof(header) + keylen, st.st_size);
+			close(fd);
+			free(key);
+			return status;
+		}
+		close(fd);
+	}
+
+	++memomisses;
+	if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) == -1)
+	{
+		free(key);
+		return nonfatalError(errno, tmp);
+	}
+	header[0] = -1;
+	header[1] = keylen;
+	write(fd, header, sizeof(header));
+	write(fd, key, keylen);
+	status = runMemoCommand(params + i, nparams - i, jobs, njobs, fd);
+	if (fstat(fd, &st))
+		st.st_size = 0;
+	/* Killed or stopped commands have partial output */
+	if (status < 0 || status >= 128 || pwrite(fd, &status, sizeof(int), 0) != sizeof(int) || rename(tmp, path))
+		unlink(tmp);
+	else
+		evictMemo(dir, &size, &count);
+	replayFile(fd, sizeof(header) + keylen, st.st_size);
+	close(fd);
+	free(key);
+	return status;
+}
+
 /* Executes internal command */
 int internalCommand(param_t *params, int nparams, job_t **jobs, int *njobs)
 {
-	int savestdin, savestdout, count, result, wasredirection;
+	int savestdin, savestdout, count, result = 0, wasredirection;
 	param_t *command;
-	savestdin =  dup(STDIN_FILENO);
-	savestdout = dup(STDOUT_FILENO);
+	fflush(stdout);
+	savestdin =  fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+	savestdout = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
 
 	command = params;
 	count = nparams;
@@ -750,8 +3245,19 @@ int internalCommand(param_t *params, int nparams, job_t **jobs, int *njobs)
 		close(savestdout);
 		return -1;
 	}
-
-	if (!strcmp(command[0].word, "exit"))
+
+	if (!strcmp(command[0].word, "exec"))
+	{
+		close(savestdin);
+		close(savestdout);
+		/* Without command redirections stay in effect for the shell itself */
+		if (count > 1)
+			executeCommand(command + 1, count - 1, *jobs, *njobs);
+		if (wasredirection)
+			free(command);
+		return 0;
+	}
+	else if (!strcmp(command[0].word, "exit"))
 		exit (0);
 	else if (!strcmp(command[0].word, "cd"))
 		result = internalChangeDir(command, count);
@@ -761,9 +3267,24 @@ int internalCommand(param_t *params, int nparams, job_t **jobs, int *njobs)
 		result = internalForeground(command, count, jobs, njobs);
 	else if (!strcmp(command[0].word, "bg"))
 		result = internalBackground(command, count, jobs, njobs);
+	else if (!strcmp(command[0].word, "source") || !strcmp(command[0].word, "."))
+		result = internalSource(command, count, jobs, njobs);
+	else if (!strcmp(command[0].word, "memo"))
+		result = internalMemo(command, count, jobs, njobs);
+	else if (!strcmp(command[0].word, "set"))
+		result = internalSet(command, count);
+	else if (!strcmp(command[0].word, "ulimit"))
+		result = internalUlimit(command, count);
+	else if (!strcmp(command[0].word, "coproc"))
+		result = internalCoproc(command, count, jobs, njobs);
+	else if (!strcmp(command[0].word, "read"))
+		result = internalRead(command, count);
+	else if (!strcmp(command[0].word, "xstat"))
+		result = runBuiltin(stdout, command, count, *jobs, *njobs);
 
 	if (wasredirection)
 		free(command);
+	fflush(stdout);
 	dup2(savestdin,  STDIN_FILENO);
 	dup2(savestdout, STDOUT_FILENO);
 	close(savestdin);
@@ -771,14 +3292,38 @@ int internalCommand(param_t *params, int nparams, job_t **jobs, int *njobs)
 	return result;
 }
 
-/* Organizes i/o redirection. Returns pid of last process in the pipeline, responsible for <, >, >> and | */
-pid_t launchCommands(param_t *params, int nparams, job_t *jobs, int njobs)
+/* Applies redirections and cpu placement of pipeline stage number stage of nstages and executes it
+   in the current process */
+void runStage(param_t *params, int nparams, int stage, int nstages, job_t *jobs, int njobs)
 {
-	pid_t pgid = getpgid(0), pid;
-	int begin = 0, divider, count, wasredirection, pipes[2][2]={{0}};
-	param_t *command;
+	param_t *command = params;
+	int count = nparams, wasredirection;
 
-	while (begin < nparams)
+	if ((wasredirection = dupFiles(params, nparams)) == -1)
+		exit(-1);
+	if (wasredirection && (command = removeRedirectors(params, nparams, &count)) == NULL)
+		exit(-1);
+	dropCoprocs(params, nparams);
+	placeStage(command, count, stage, nstages);
+	executeCommand(command, count, jobs, njobs);
+}
+
+/* Organizes i/o redirection. Returns pid of last process in the pipeline, responsible for <, >, >> and |.
+   Forked processes are put under limit, their stdout and stderr go to outfd unless it is -1 */
+pid_t launchCommands(param_t *params, int nparams, limit_t *limit, int outfd, job_t *jobs, int njobs)
+{
+	pid_t pgid = getpgid(0), pid = -1;
+	int begin = 0, divider, pipes[2][2]={{0}}, forked = 0, stage, nstages = countStages(params, nparams);
+	long long forkstart;
+
+	setEnvVars();
+	if (nstages > 1 && pipelineaffinity != AF_NONE)
+	{
+		affinitybase = affinitynext;
+		affinitynext = (affinitynext + nstages) % CPU_SETSIZE;
+	}
+
+	for (stage = 0; begin < nparams; ++stage)
 	{
 		divider = findDivider(params, nparams, begin, WT_PIPE, WT_PIPE);
 
@@ -786,19 +3331,37 @@ pid_t launchCommands(param_t *params, int nparams, job_t *jobs, int njobs)
 		{
 			if (pipes[0][0])
 				close(pipes[0][0]);
-			close(pipes[1][1]);
+			if (pipes[1][1] != -1)
+				close(pipes[1][1]);
 			pipes[0][0] = pipes[1][0];
 		}
 		if (divider < nparams)
 			pipe(pipes[1]);
 
+		forkstart = TRACE_NOW();
+		if (divider < nparams && runBuiltinStage(params + begin, divider - begin, jobs, njobs, pipes[1][1], outfd) == 0)
+		{
+			traceSpan("builtin", params[begin].word, forkstart);
+			close(pipes[1][1]);
+			pipes[1][1] = -1;
+			begin = divider + 1;
+			continue;
+		}
 		if ((pid = fork()) == -1)
 			return (pid_t)nonfatalError(errno, NULL);
-		if (begin == 0 && !issubshell)
+		if (forked++ == 0 && !issubshell)
 			pgid = pid;
 		if (!pid)
 		{
+			initChild();
 			setpgid(0, pgid);
+			applyLimit(limit);
+			if (outfd != -1)
+			{
+				dup2(outfd, STDOUT_FILENO);
+				dup2(outfd, STDERR_FILENO);
+				close(outfd);
+			}
 
 			if (begin > 0)
 			{
@@ -812,15 +3375,10 @@ pid_t launchCommands(param_t *params, int nparams, job_t *jobs, int njobs)
 				close(pipes[1][1]);
 			}
 
-			count = nparams;
-			command = params;
-			if ((wasredirection = dupFiles(params + begin, divider - begin)) == -1)
-				exit(-1);
-			if (wasredirection && (command = removeRedirectors(params + begin, divider - begin, &count)) == NULL)
-				exit(-1);
-			executeCommand(command, count, jobs, njobs);
+			runStage(params + begin, divider - begin, stage, nstages, jobs, njobs);
 		}
 		setpgid(pid, pgid);
+		traceEvent("fork", params[begin].word, forkstart, TRACE_NOW() - forkstart, pid, pgid);
 		begin = divider + 1;
 	}
 
@@ -832,8 +3390,15 @@ pid_t launchCommands(param_t *params, int nparams, job_t *jobs, int njobs)
 /* Executes one job in its own process group, responsible for && and || */
 int controlJob(param_t *params, int nparams, int isforeground, job_t **jobs, int *njobs)
 {
-	int begin = 0, divider, exitstatus = 0;
-	pid_t pid, pgid;
+	int begin = 0, divider, exitstatus = 0, tail = tailexec, skip;
+	long long forkstart, peak;
+	limit_t limit;
+	deadline_t timeout;
+	capture_t *cap;
+	int capfd;
+	pid_t pid, pgid, key;
+
+	tailexec = 0;
 
 	while (begin < nparams)
 	{
@@ -846,13 +3411,53 @@ int controlJob(param_t *params, int nparams, int isforeground, job_t **jobs, int
 
 		if (isforeground && isInternal(params + begin, divider - begin))
 		{
+			STAT_ADD(builtins, 1);
+			forkstart = TRACE_NOW();
 			exitstatus = internalCommand(params + begin, divider - begin, jobs, njobs);
+			traceSpan("builtin", params[begin].word, forkstart);
+			begin = divider + 1;
+			continue;
+		}
+
+		if ((skip = jobPrefixes(params + begin, divider - begin, &limit, &timeout)) == -1)
+		{
+			exitstatus = -1;
+			begin = divider + 1;
+			continue;
+		}
+		if (checkArgs(params + begin + skip, divider - begin - skip) == -1)
+		{
+			releaseCgroup(&limit.cgroup);
+			exitstatus = -1;
 			begin = divider + 1;
 			continue;
 		}
 
-		if ((pid = launchCommands(params + begin, divider - begin, *jobs, *njobs)) == (pid_t)-1)
+		/* Nothing runs after the last simple command, so the already forked shell can become it,
+		   unless it has deadlines to serve, background output to capture, coprocesses to close
+		   or a job cgroup to remove */
+		if (tail && isforeground && divider == nparams && timeout.when == 0 && ndeadlines == 0 && ncaptures == 0
+		    && ncoprocs == 0 && limit.cgroup == NULL
+		    && findDivider(params + begin, divider - begin, 0, WT_PIPE, WT_PIPE) == divider - begin)
 		{
+			setEnvVars();
+			fflush(stdout);
+			applyLimit(&limit);
+			runStage(params + begin + skip, divider - begin - skip, 0, 1, *jobs, *njobs);
+		}
+
+		/* Output of captured background job goes to the pipe drained by the shell */
+		capfd = -1;
+		cap = !isforeground && !issubshell && capturebg ? openCapture(&capfd) : NULL;
+		forkstart = traceTime();
+		pid = launchCommands(params + begin + skip, divider - begin - skip, &limit, capfd, *jobs, *njobs);
+		statTime(stats->launch, traceTime() - forkstart);
+		if (cap != NULL)
+			close(capfd);
+		if (pid == (pid_t)-1)
+		{
+			releaseCgroup(&limit.cgroup);
+			releaseCapture(&cap);
 			exitstatus = -1;
 			begin = divider + 1;
 			continue;
@@ -860,14 +3465,42 @@ int controlJob(param_t *params, int nparams, int isforeground, job_t **jobs, int
 		pgid = getpgid(pid);
 		exitstatus = -1;
 
+		/* Job sharing process group with subshell is signaled by its last pid */
+		key = pgid == getpgrp() ? pid : pgid;
+		if (timeout.when == 0 && !isforeground && jobdeadline > 0)
+			timeout.when = jobdeadline * 1000000LL;
+		if (timeout.when > 0)
+			addDeadline(key, -pgid, timeout.when, timeout.sig, timeout.killafter);
+
+		peak = 0;
 		if (isforeground)
 		{
-			if (waitProcessGroup(pid, pgid, &exitstatus))
+			if (waitProcessGroup(pid, pgid, &exitstatus, limit.active ? &peak : NULL))
 				addJob(jobs, njobs, params + begin, divider - begin, pgid, ST_JUSTSTP);
+			else
+			{
+				cancelDeadlines(key);
+				if (expiredjob == key)
+					exitstatus = exitstatus == 128 + SIGKILL ? exitstatus : 124;
+				expiredjob = 0;
+			}
 		}
 		else if (!issubshell)
 			addJob(jobs, njobs, params + begin, divider - begin, pgid, ST_RUNNING);
 
+		/* Limited job keeps its cgroup while it is in the jobs list */
+		if (limit.active && *njobs > 0 && (*jobs)[*njobs - 1].pgid == pgid && (*jobs)[*njobs - 1].cgroup == NULL)
+		{
+			(*jobs)[*njobs - 1].cgroup = limit.cgroup;
+			(*jobs)[*njobs - 1].peak = peak;
+		}
+		else
+			releaseCgroup(&limit.cgroup);
+		if (cap != NULL && *njobs > 0 && (*jobs)[*njobs - 1].pgid == pgid)
+			(*jobs)[*njobs - 1].capture = cap;
+		else
+			releaseCapture(&cap);
+
 		begin = divider + 1;
 	}
 
@@ -877,9 +3510,12 @@ int controlJob(param_t *params, int nparams, int isforeground, job_t **jobs, int
 /* Launches background and foreground jobs, responsible for ; and & */
 int launchJobs(param_t *params, int nparams, job_t **jobs, int *njobs)
 {
-	int begin = 0, divider, isforeground, needcontrol, exitstatus;
+	int begin = 0, divider, isforeground, needcontrol, exitstatus = 0, tail = tailexec, capfd;
+	long long forkstart;
+	capture_t *cap;
 	pid_t pid;
 
+	tailexec = 0;
 	if (issubshell)
 		signal(SIGTTOU, SIG_IGN);
 
@@ -891,19 +3527,47 @@ int launchJobs(param_t *params, int nparams, job_t **jobs, int *njobs)
 
 		if (needcontrol)
 		{
+			setEnvVars();
+			cap = !issubshell && capturebg ? openCapture(&capfd) : NULL;
+			forkstart = TRACE_NOW();
 			if ((pid = fork()) == -1)
+			{
+				if (cap != NULL)
+					close(capfd);
+				releaseCapture(&cap);
 				return nonfatalError(errno, NULL);
+			}
 			if (!pid)
 			{
+				initChild();
 				setpgid(0, 0);
+				if (cap != NULL)
+				{
+					dup2(capfd, STDOUT_FILENO);
+					dup2(capfd, STDERR_FILENO);
+					close(capfd);
+				}
 				issubshell = 1;
-				exit(launchJobs(params, nparams - 1, jobs, njobs));
+				tailexec = 1;
+				exit(launchJobs(params + begin, divider - begin, jobs, njobs));
 			}
 			setpgid(pid, pid);
-			addJob(jobs, njobs, params + begin, divider - begin, pid, ST_RUNNING);
+			traceEvent("fork", "subshell", forkstart, TRACE_NOW() - forkstart, pid, pid);
+			if (cap != NULL)
+				close(capfd);
+			if (addJob(jobs, njobs, params + begin, divider - begin, pid, ST_RUNNING) == 0)
+				(*jobs)[*njobs - 1].capture = cap;
+			else
+				releaseCapture(&cap);
+			if (jobdeadline > 0)
+				addDeadline(pid, -pid, jobdeadline * 1000000LL, SIGTERM, 0);
 		}
 		else
+		{
+			tailexec = tail && isforeground && divider >= nparams - 1;
 			exitstatus = controlJob(params + begin, divider - begin, isforeground, jobs, njobs);
+			tailexec = 0;
+		}
 
 		begin = divider + 1;
 	}
@@ -911,13 +3575,13 @@ int launchJobs(param_t *params, int nparams, job_t **jobs, int *njobs)
 	return exitstatus;
 }
 
-/* Checks if syntax is correct. Returns 1 on correct syntax */
-int checkSyntax(param_t *params, int nparams)
+/* Finds syntax error in params. Returns index of the wrong param, nparams for unexpected end or -1 on correct syntax */
+int findSyntaxError(param_t *params, int nparams)
 {
 	int i, bracketcnt = 0, nospecial = 1, noend = 1;
 
 	if (nparams == 0)
-		return 1;
+		return -1;
 
 	for (i = 0; i < nparams; ++i)
 	{
@@ -945,66 +3609,590 @@ int checkSyntax(param_t *params, int nparams)
 			nospecial = noend = 0;
 	}
 
-	if (i < nparams || bracketcnt > 0 || noend)
+	return i < nparams || bracketcnt > 0 || noend ? i : -1;
+}
+
+/* Checks syntax of params and reports the error. Returns 1 if the syntax is correct */
+int checkSyntax(param_t *params, int nparams)
+{
+	int i = findSyntaxError(params, nparams);
+
+	if (i == -1)
+		return 1;
+	if (i < nparams)
+		error(0, 0, "syntax error near %s", params[i].word);
+	else
+		error(0, 0, "unexpected end of file");
+	return 0;
+}
+
+/* Reads whole file into script, lines with syntax errors are reported and skipped.
+   When keeptext is set lines using variables or having syntax errors are stored as text, so the script can be cached:
+   variables are substituted and errors are reported every time the script runs */
+int parseScript(FILE *in, script_t *script, int keeptext)
+{
+	param_t *params = NULL;
+	line_t *ptr;
+	char *text = NULL;
+	long begin, end;
+	int nparams;
+	result_t result;
+
+	memset(script, 0, sizeof(script_t));
+	lexedvars = 0;
+	while ((begin = ftell(in), result = readCommand(in, &params, &nparams)) != RET_EOF)
+	{
+		if (result == RET_MEMORYERR || nparams == 0 || (!keeptext && !checkSyntax(params, nparams)))
+		{
+			clearParams(&params, nparams);
+			lexedvars = 0;
+			continue;
+		}
+		if (keeptext && (lexedvars || findSyntaxError(params, nparams) != -1))
+		{
+			clearParams(&params, nparams);
+			nparams = 0;
+			end = ftell(in);
+			if (begin == -1 || end == -1 || (text = malloc(end - begin + 1)) == NULL)
+				return nonfatalError(errno, NULL);
+			fseek(in, begin, SEEK_SET);
+			text[fread(text, 1, end - begin, in)] = '\0';
+			fseek(in, end, SEEK_SET);
+		}
+		lexedvars = 0;
+		if ((ptr = realloc(script->lines, (script->nlines + 1) * sizeof(line_t))) == NULL)
+		{
+			clearParams(&params, nparams);
+			free(text);
+			return nonfatalError(errno, NULL);
+		}
+		script->lines = ptr;
+		script->lines[script->nlines].params = params;
+		script->lines[script->nlines].text = text;
+		script->lines[script->nlines++].nparams = nparams;
+		params = NULL;
+		text = NULL;
+	}
+	clearParams(&params, nparams);
+	return 0;
+}
+
+/* Frees script lines */
+void clearScript(script_t *script)
+{
+	int i;
+
+	if (script->data != NULL)
+	{
+		free(script->data);
+		free(script->pool);
+	}
+	else
+		for (i = 0; i < script->nlines; ++i)
+		{
+			clearParams(&script->lines[i].params, script->lines[i].nparams);
+			free(script->lines[i].text);
+		}
+	free(script->lines);
+	memset(script, 0, sizeof(script_t));
+}
+
+/* Runs every line of script in the current shell, returns exit status of the last one */
+int runScript(script_t *script, job_t **jobs, int *njobs)
+{
+	int i, exitstatus = 0, tail = tailexec;
+
+	script_t line;
+	FILE *in;
+
+	for (i = 0; i < script->nlines; ++i)
 	{
-		if (i < nparams)
-			error(0, 0, "syntax error near %s", params[i].word);
-		else
-			error(0, 0, "unexpected end of file");
+		tailexec = tail && i == script->nlines - 1;
+		if (script->lines[i].text == NULL)
+			exitstatus = launchJobs(script->lines[i].params, script->lines[i].nparams, jobs, njobs);
+		else if ((in = fmemopen(script->lines[i].text, strlen(script->lines[i].text), "r")) != NULL)
+		{
+			if (parseScript(in, &line, 0) == 0)
+				exitstatus = runScript(&line, jobs, njobs);
+			clearScript(&line);
+			fclose(in);
+		}
+	}
+	tailexec = 0;
+	return exitstatus;
+}
+
+/* Frees source cache entry, unless some source builtin is still running its script */
+void releaseSourceCache(srccache_t *entry)
+{
+	if (entry->busy > 0 || !entry->stale)
+		return;
+	clearScript(&entry->script);
+	free(entry);
+}
+
+/* Returns parsed file from source cache, parses it if the file has changed since it was cached */
+srccache_t *getSourceCache(char *path, int verbose)
+{
+	srccache_t *entry, **prev;
+	struct stat st;
+	FILE *in;
+
+	if (stat(path, &st))
+	{
+		nonfatalError(errno, path);
+		return NULL;
+	}
+	for (prev = &sourcecache; (entry = *prev) != NULL; prev = &entry->next)
+		if (entry->dev == st.st_dev && entry->ino == st.st_ino)
+			break;
+	if (entry != NULL && entry->size == st.st_size && entry->mtime.tv_sec == st.st_mtim.tv_sec
+	    && entry->mtime.tv_nsec == st.st_mtim.tv_nsec)
+	{
+		++sourcehits;
+		if (verbose)
+			fprintf(stderr, "source: %s: cached\n", path);
+		return entry;
+	}
+	if (entry != NULL)
+	{
+		*prev = entry->next;
+		entry->stale = 1;
+		releaseSourceCache(entry);
+	}
+
+	++sourcemisses;
+	if (verbose)
+		fprintf(stderr, "source: %s: parsed\n", path);
+	if ((in = fopen(path, "r")) == NULL)
+	{
+		nonfatalError(errno, path);
+		return NULL;
+	}
+	if ((entry = calloc(1, sizeof(srccache_t))) == NULL || parseScript(in, &entry->script, 1))
+	{
+		nonfatalError(errno, NULL);
+		if (entry != NULL)
+			clearScript(&entry->script);
+		free(entry);
+		fclose(in);
+		return NULL;
+	}
+	fclose(in);
+	entry->dev = st.st_dev;
+	entry->ino = st.st_ino;
+	entry->mtime = st.st_mtim;
+	entry->size = st.st_size;
+	entry->next = sourcecache;
+	sourcecache = entry;
+	return entry;
+}
+
+/* source and . internal commands: run the file in the current shell. With -v tell if the parsed file was
+   taken from cache, without file show cache statistics */
+int internalSource(param_t *params, int nparams, job_t **jobs, int *njobs)
+{
+	int verbose = nparams > 1 && !strcmp(params[1].word, "-v"), exitstatus, count = 0;
+	srccache_t *entry;
+
+	if (verbose && nparams == 2)
+	{
+		for (entry = sourcecache; entry != NULL; entry = entry->next)
+			++count;
+		printf("%d hits, %d misses, %d cached\n", sourcehits, sourcemisses, count);
 		return 0;
 	}
+	if (nparams < 2 + verbose)
+		return nonfatalError(0, "source: filename argument required");
+	if ((entry = getSourceCache(params[1 + verbose].word, verbose)) == NULL)
+		return -1;
 
-	return 1;
+	++entry->busy;
+	exitstatus = runScript(&entry->script, jobs, njobs);
+	--entry->busy;
+	releaseSourceCache(entry);
+	return exitstatus;
 }
 
-/* Sets some environmental variables for later use */
-int setEnvVars()
+/* Fills cache header with identity of the source file */
+void makeCacheHeader(cachehdr_t *hdr, struct stat *st)
 {
-	char buf[PATH_MAX];
-	int len;
+	memset(hdr, 0, sizeof(cachehdr_t));
+	strcpy(hdr->magic, CACHE_MAGIC);
+	hdr->dev = st->st_dev;
+	hdr->ino = st->st_ino;
+	hdr->mtimesec = st->st_mtim.tv_sec;
+	hdr->mtimensec = st->st_mtim.tv_nsec;
+	hdr->size = st->st_size;
+}
 
-	if ((len = readlink("/proc/self/exe", buf, PATH_MAX - 1)) == -1)
-		return nonfatalError(errno, NULL);
-	buf[len] = '\0';
-	if (setenv("SHELL", buf, 1) == -1)
-		return nonfatalError(errno, NULL);
-	sprintf (buf, "%d", geteuid ());
-	if (setenv("EUID", buf, 1) == -1)
+/* Saves parsed script into cache file. After the header every line has its params count followed by
+   type byte and null terminated word of every param, or zero count followed by line text. Written to temporary file and renamed, so readers
+   never see half of it */
+int saveScriptCache(char *path, struct stat *st, script_t *script)
+{
+	cachehdr_t hdr;
+	char tmp[PATH_MAX];
+	FILE *out;
+	int i, j;
+
+	makeCacheHeader(&hdr, st);
+	hdr.nlines = script->nlines;
+	hdr.datalen = script->nlines * sizeof(int);
+	for (i = 0; i < script->nlines; ++i)
+	{
+		for (j = 0, hdr.nparams += script->lines[i].nparams; j < script->lines[i].nparams; ++j)
+			hdr.datalen += strlen(script->lines[i].params[j].word) + 2;
+		if (script->lines[i].text != NULL)
+			hdr.datalen += strlen(script->lines[i].text) + 1;
+	}
+
+	snprintf(tmp, PATH_MAX, "%s.%d", path, getpid());
+	if ((out = fopen(tmp, "w")) == NULL)
+		return -1;
+	fwrite(&hdr, sizeof(hdr), 1, out);
+	for (i = 0; i < script->nlines; ++i)
+	{
+		fwrite(&script->lines[i].nparams, sizeof(int), 1, out);
+		if (script->lines[i].text != NULL)
+		{
+			fputs(script->lines[i].text, out);
+			putc('\0', out);
+		}
+		for (j = 0; j < script->lines[i].nparams; ++j)
+		{
+			putc(script->lines[i].params[j].type, out);
+			fputs(script->lines[i].params[j].word, out);
+			putc('\0', out);
+		}
+	}
+	if (fclose(out) || rename(tmp, path))
+	{
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/* Loads script from cache file if it was made from the file described by st. Returns -1 if there is no valid cache,
+   any malformed line rejects the whole cache */
+int loadScriptCache(char *path, struct stat *st, script_t *script)
+{
+	cachehdr_t hdr, expected;
+	char buf[4096], *data, *end;
+	int fd, len, i, j, nparams;
+	param_t *params;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+	/* Usual rc file fits into one read */
+	len = read(fd, buf, sizeof(buf));
+	makeCacheHeader(&expected, st);
+	if (len < (int)sizeof(hdr))
+	{
+		close(fd);
+		return -1;
+	}
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (memcmp(&hdr, &expected, offsetof(cachehdr_t, nlines)) || hdr.nlines < 0 || hdr.nparams < 0
+	    || hdr.datalen < 0 || (data = malloc(hdr.datalen + 1)) == NULL)
+	{
+		close(fd);
+		return -1;
+	}
+	len -= sizeof(hdr);
+	memcpy(data, buf + sizeof(hdr), len < hdr.datalen ? len : hdr.datalen);
+	if (len < hdr.datalen && read(fd, data + len, hdr.datalen - len) != hdr.datalen - len)
+		len = -1;
+	close(fd);
+
+	memset(script, 0, sizeof(script_t));
+	script->data = data;
+	script->pool = params = malloc((hdr.nparams + 1) * sizeof(param_t));
+	script->lines = malloc((hdr.nlines + 1) * sizeof(line_t));
+	if (len == -1 || params == NULL || script->lines == NULL)
+	{
+		clearScript(script);
+		return -1;
+	}
+
+	data[hdr.datalen] = '\0';
+	end = data + hdr.datalen;
+	for (i = 0; i < hdr.nlines; ++i)
+	{
+		if (end - data < (int)sizeof(int))
+			break;
+		memcpy(&nparams, data, sizeof(int));
+		data += sizeof(int);
+		if (nparams < 0 || params + nparams > script->pool + hdr.nparams)
+			break;
+		script->lines[i].params = params;
+		script->lines[i].nparams = nparams;
+		script->lines[i].text = NULL;
+		if (nparams == 0)
+		{
+			if (data >= end)
+				break;
+			script->lines[i].text = data;
+			data += strlen(data) + 1;
+		}
+		for (j = 0; j < nparams && data < end && (unsigned char)*data <= WT_DUPIN; ++j, ++params)
+		{
+			params->type = (unsigned char)*data++;
+			params->word = data;
+			data += strlen(data) + 1;
+		}
+		if (j < nparams || data > end || findSyntaxError(script->lines[i].params, nparams) != -1)
+			break;
+		script->nlines = i + 1;
+	}
+	if (i < hdr.nlines || data != end)
+	{
+		clearScript(script);
+		return -1;
+	}
+	return 0;
+}
+
+/* Runs ~/.xishrc. Parsed file is cached in ~/.xishrc.cache, so usual start costs one stat and one read */
+int runRcFile(job_t **jobs, int *njobs)
+{
+	char rc[PATH_MAX], cache[PATH_MAX], *home = getenv("HOME");
+	struct stat st;
+	script_t script;
+	FILE *in;
+	int exitstatus;
+
+	if (home == NULL)
+		return 0;
+	snprintf(rc, PATH_MAX, "%s/%s", home, RC_FILE);
+	snprintf(cache, PATH_MAX, "%s/%s", home, RC_CACHE);
+	if (stat(rc, &st))
+		return 0;
+
+	if (loadScriptCache(cache, &st, &script))
+	{
+		if ((in = fopen(rc, "r")) == NULL)
+			return nonfatalError(errno, rc);
+		if (parseScript(in, &script, 1))
+		{
+			fclose(in);
+			clearScript(&script);
+			return -1;
+		}
+		fclose(in);
+		saveScriptCache(cache, &st, &script);
+	}
+
+	exitstatus = runScript(&script, jobs, njobs);
+	clearScript(&script);
+	return exitstatus;
+}
+
+/* Runs the string as a script in the current shell, used by -c and server workers */
+int runString(char *text, job_t **jobs, int *njobs)
+{
+	script_t script;
+	FILE *in;
+	char *line;
+	int exitstatus, len = strlen(text);
+
+	/* readCommand() drops unterminated last line */
+	if ((line = malloc(len + 2)) == NULL)
 		return nonfatalError(errno, NULL);
-	if (getlogin_r(buf, PATH_MAX) || setenv("USER", buf, 1) == -1)
+	memcpy(line, text, len);
+	line[len] = '\n';
+	line[len + 1] = '\0';
+	if ((in = fmemopen(line, len + 1, "r")) == NULL)
+	{
+		free(line);
 		return nonfatalError(errno, NULL);
+	}
+	if (parseScript(in, &script, 0))
+		exitstatus = -1;
+	else
+		exitstatus = runScript(&script, jobs, njobs);
+	fclose(in);
+	free(line);
+	clearScript(&script);
+	return exitstatus;
+}
+
+/* Sends exit status to the client once. Registered with atexit, so the client gets status 0 after exit builtin too */
+void replyStatus()
+{
+	int status = 0;
+
+	if (replyfd == -1 || replypid != getpid())
+		return;
+	fflush(stdout);
+	fflush(stderr);
+	write(replyfd, &status, sizeof(int));
+	close(replyfd);
+	replyfd = -1;
+}
+
+/* Server worker: receives the script length and client's stdin, stdout and stderr, then the script itself.
+   Runs the script and sends back its exit status, cut to 0-255 like the one of xish -c */
+void serveRequest(int conn, job_t **jobs, int *njobs)
+{
+	char control[CMSG_SPACE(3 * sizeof(int))], *text;
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	int len, done, n, fds[3], i, status;
+
+	iov.iov_base = &len;
+	iov.iov_len = sizeof(int);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if (recvmsg(conn, &msg, MSG_CMSG_CLOEXEC) != sizeof(int) || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL
+	    || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)) || len < 0 || len > SERVE_MAXLEN)
+		exit(-1);
+	memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+	if ((text = malloc(len + 1)) == NULL)
+		fatalError();
+	for (done = 0; done < len; done += n)
+		if ((n = read(conn, text + done, len - done)) <= 0)
+			exit(-1);
+	text[len] = '\0';
+
+	for (i = 0; i < 3; ++i)
+	{
+		dup2(fds[i], i);
+		close(fds[i]);
+	}
+	replyfd = conn;
+	replypid = getpid();
+	atexit(replyStatus);
+
+	status = runString(text, jobs, njobs) & 0xff;
+	fflush(stdout);
+	fflush(stderr);
+	write(conn, &status, sizeof(int));
+	replyfd = -1;
+	exit(0);
+}
+
+/* Checks that the client runs as the same user as the server. Returns -1 if it doesn't */
+int checkPeer(int conn)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
 
+	if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+		return nonfatalError(errno, "SO_PEERCRED");
+	if (cred.uid != geteuid())
+	{
+		error(0, 0, "client with uid %d refused", (int)cred.uid);
+		return -1;
+	}
 	return 0;
 }
 
+/* Server mode: the initialized shell listens on unix socket and forks a worker for every request.
+   Only a stale socket is replaced at path, and workers are reaped as soon as SIGCHLD comes */
+int serve(char *path, job_t **jobs, int *njobs)
+{
+	struct sockaddr_un addr = { AF_UNIX };
+	struct stat st;
+	int sock, conn, ready;
+	pid_t pid;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return nonfatalError(ENAMETOOLONG, path);
+	strcpy(addr.sun_path, path);
+	if (lstat(path, &st) == 0)
+	{
+		if (!S_ISSOCK(st.st_mode))
+			return nonfatalError(EEXIST, path);
+		unlink(path);
+	}
+	if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1 || bind(sock, (struct sockaddr *)&addr, sizeof(addr))
+	    || listen(sock, SOMAXCONN))
+		return nonfatalError(errno, path);
+
+	/* Everything workers would otherwise do on their own is done once here */
+	setEnvVars();
+	issubshell = 1;
+	isinteractive = 0;
+	fflush(stdout);
+	initEvents();
+
+	while (1)
+	{
+		while (waitpid(-1, NULL, WNOHANG) > 0);
+		if (timerfd != -1 && (ready = waitEvents(sock)) != 1)
+		{
+			if (ready == -1)
+				break;
+			continue;
+		}
+		if ((conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC)) == -1)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+		if (checkPeer(conn) == -1)
+		{
+			close(conn);
+			continue;
+		}
+		if ((pid = fork()) == -1)
+			nonfatalError(errno, NULL);
+		else if (!pid)
+		{
+			initChild();
+			close(sock);
+			setpgid(0, 0);
+			serveRequest(conn, jobs, njobs);
+		}
+		close(conn);
+	}
+
+	return nonfatalError(errno, path);
+}
+
 /* Initialize xish */
-int doInit(int argc, char **argv)
+int doInit(int argc, char **argv, job_t **jobs, int *njobs)
 {
 	strcpy(argv[0], "xish");
-	if (setEnvVars())
-		return -1;
+	isinteractive = isatty(STDIN_FILENO);
+	traceInit();
+	statsInit();
+	runRcFile(jobs, njobs);
 	return 0;
 }
 
 /* Show input prompt */
 void showPrompt()
 {
-	char hostname[HOST_NAME_MAX], *cwd = getcwd(NULL, 0);
-	if (gethostname(hostname, HOST_NAME_MAX) || cwd == NULL)
+	char hostname[HOST_NAME_MAX], *cwd, *user;
+
+	if (!isinteractive)
+		return;
+	setEnvVars();
+	user = getenv("USER");
+	cwd = getcwd(NULL, 0);
+	if (gethostname(hostname, HOST_NAME_MAX) || cwd == NULL || user == NULL)
 	{
 		printf(DFL_PROMPT);
 		if (cwd != NULL)
 			free(cwd);
 		return;
 	}
-	printf("%s@%s %s $ ", getlogin(), hostname, cwd);
+	printf("%s@%s %s $ ", user, hostname, cwd);
 	free(cwd);
 }
 
+#ifndef XISH_NO_MAIN
 /* Just a main */
 int main(int argc, char **argv)
 {
-	int nparams, njobs = 0;
+	int nparams, njobs = 0, issyntaxok;
 	param_t *params = NULL;
 	job_t *jobs = NULL;
 	result_t result;
@@ -1013,16 +4201,27 @@ int main(int argc, char **argv)
 	signal(SIGTSTP, SIG_IGN);
 	signal(SIGTTOU, SIG_IGN);
 
-	if (doInit(argc, argv) == -1)
+	if (doInit(argc, argv, &jobs, &njobs) == -1)
 		error(0, 0, "initialisation failed, it is not advised to continue");
+	if (argc > 2 && !strcmp(argv[1], "-c"))
+	{
+		tailexec = statsfile == NULL; /* Replaced shell wouldn't dump the statistics */
+		return runString(argv[2], &jobs, &njobs);
+	}
+	if (argc > 2 && !strcmp(argv[1], "--serve"))
+		return serve(argv[2], &jobs, &njobs);
 	showPrompt();
 
-	while ((result = readCommand(&params, &nparams)) != RET_EOF)
+	while ((result = readCommand(stdin, &params, &nparams)) != RET_EOF)
 	{
-		if (result != RET_MEMORYERR && checkSyntax(params, nparams))
+		issyntaxok = result != RET_MEMORYERR && checkSyntax(params, nparams);
+		if (parsestart)
+			traceSpan("parse", NULL, parsestart);
+		parsestart = 0;
+		if (issyntaxok)
 			launchJobs(params, nparams, &jobs, &njobs);
 		checkJobs(&jobs, &njobs);
-		showJobs(jobs, njobs, 0);
+		showJobs(stdout, jobs, njobs, 0);
 		deleteDoneJobs (&jobs, &njobs);
 		showPrompt();
 		clearParams(&params, nparams);
@@ -1033,4 +4232,5 @@ int main(int argc, char **argv)
 	clearJobs(&jobs, njobs);
 
 	return 0;
-}
\ No newline at end of file
+}
+#endif
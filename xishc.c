@@ -0,0 +1,80 @@
+/* xishc - client for xish server mode (xish --serve <socket>).
+   Passes its stdin, stdout and stderr to the server with the command and exits with the command's status */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <error.h>
+#include <errno.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* Runs text on the server listening at path, returns its exit status or -1 */
+int sendRequest(char *path, char *text)
+{
+	struct sockaddr_un addr = { AF_UNIX };
+	char control[CMSG_SPACE(3 * sizeof(int))] = { 0 };
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	int sock, len, done, n, status, fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		error(0, ENAMETOOLONG, "%s", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)))
+	{
+		error(0, errno, "%s", path);
+		if (sock != -1)
+			close(sock);
+		return -1;
+	}
+
+	len = strlen(text);
+	iov.iov_base = &len;
+	iov.iov_len = sizeof(int);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(3 * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, 3 * sizeof(int));
+	status = -1;
+	if (sendmsg(sock, &msg, 0) == sizeof(int))
+	{
+		for (done = 0; done < len; done += n)
+			if ((n = write(sock, text + done, len - done)) <= 0)
+				break;
+		if (done == len && read(sock, &status, sizeof(int)) != sizeof(int))
+		{
+			error(0, 0, "server closed connection");
+			status = -1;
+		}
+	}
+	close(sock);
+	return status;
+}
+
+#ifndef XISH_NO_MAIN
+int main(int argc, char **argv)
+{
+	int status;
+
+	if (argc != 3)
+	{
+		fprintf(stderr, "usage: xishc <socket> <command>\n");
+		return 2;
+	}
+	if ((status = sendRequest(argv[1], argv[2])) == -1)
+		return 2;
+	return status;
+}
+#endif